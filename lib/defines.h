@@ -7,12 +7,20 @@
 
 #define DEF_PORT 50000
 
-#define ETH_FRAME_LEN 14
+#define DEF_READ 65536
+
+#define DEF_CONNS 4096
+
+#define DEF_BACKLOG 1024
 
 #ifndef STREAMER_ENTRY
 #define STREAMER_ENTRY streamer
 #endif
 
+#ifndef STREAMER_EVENTS
+#define STREAMER_EVENTS streamer_events
+#endif
+
 #ifndef STREAMER_BOOTSTRAP
 #define STREAMER_BOOTSTRAP streamer_init
 #endif
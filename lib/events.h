@@ -0,0 +1,57 @@
+#ifndef __EVENTS__
+#define __EVENTS__
+
+#include <stdint.h>
+
+
+/* Event-driven stream state
+ *
+ * Passed to every callback of an event-driven streamer. The core fills in
+ * conn and acked, the streamer can keep its own per-stream state in data.
+ *
+ * A streamer asks for events by changing the stream state from within a
+ * callback: set want_write to get on_writable() calls whenever the send
+ * buffer has room, and set interval to get on_timer() calls every interval
+ * nanoseconds (zero disables the timer). For schedules that aren't evenly
+ * spaced, set deadline to get a single on_timer() call at that point in time
+ * (CLOCK_MONOTONIC nanoseconds); it is cleared when it expires, and takes
+ * precedence over interval. Changes take effect when the callback returns.
+ */
+typedef struct {
+	int conn;                // connection socket descriptor
+	void* data;              // streamer private data
+	int want_write;          // call on_writable() when the connection is writable
+	uint64_t interval;       // call on_timer() this often (nanoseconds)
+	uint64_t deadline;       // call on_timer() once at this time (CLOCK_MONOTONIC nanoseconds)
+	uint64_t acked;          // number of bytes acknowledged by the receiver
+} stream_ev_t;
+
+
+
+/* Event-driven streamer callbacks
+ *
+ * Instead of a blocking entry point, a streamer can export a structure of
+ * callbacks named streamer_events. The core then runs the stream from an
+ * event loop shared with other streams, and stops it simply by not calling
+ * it again.
+ *
+ * open() is called when the stream starts, with the argument values given on
+ * the command line (see register_argument()). The other callbacks are called
+ * on the events the streamer has asked for; on_ack() is called with the
+ * number of newly acknowledged bytes whenever the stream gets any event and
+ * the receiver has acknowledged more data. Any callback can be NULL.
+ *
+ * open() and the event callbacks return 0 to continue, a positive value when
+ * the stream is complete, or a negative value on failure. close() is called
+ * once the stream is done (unless open() failed), and returns the status
+ * code of the stream.
+ */
+typedef struct {
+	int (*open)(stream_ev_t* stream, char const** args);
+	int (*on_writable)(stream_ev_t* stream);
+	int (*on_timer)(stream_ev_t* stream, uint64_t expirations);
+	int (*on_ack)(stream_ev_t* stream, uint64_t acked);
+	int (*close)(stream_ev_t* stream);
+} events_t;
+
+#endif
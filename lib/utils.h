@@ -5,21 +5,13 @@
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <pcap.h>
 
 
 
-/* Length of an ethernet frame header
- * This is usually 14 bytes/octets long, but can be 4 bytes longer (total of 18)
- * if 802.1Q VLAN tagging is enabled.
- */
-#ifndef ETH_FRAME_LEN
-#define ETH_FRAME_LEN 14
-#endif
-
-
-
 /* A segment descriptor 
  * 
  * Describes properties of a byte stream segment captured by the filter.
@@ -74,14 +66,73 @@ int lookup_dev(int socket_desc, char* devname, int len);
 
 
 
+/* Socket options
+ *
+ * Options applied by create_socket() when the socket is set up. Pass NULL to
+ * create_socket() in order to use the defaults (all zero).
+ *
+ * The profile is a comma-separated list of profile names and name=value
+ * options, applied in order before connecting. The profiles are default,
+ * thin (nodelay, low unsent watermark and interactive priority), corked and
+ * bulk (large buffers), and the options are nodelay, cork, lowat
+ * (TCP_NOTSENT_LOWAT), pacing (SO_MAX_PACING_RATE, bytes/s), congestion
+ * (algorithm name), user-timeout (ms), priority, sndbuf and rcvbuf. For
+ * example "thin,congestion=bbr".
+ */
+typedef struct {
+	int reuse_port;          // bind with SO_REUSEPORT (several listening sockets share the port)
+	int backlog;             // listen backlog (0 means DEF_BACKLOG)
+	char const* profile;     // socket option profile of connecting sockets (NULL for defaults)
+} sockopt_t;
+
+
+
 /* Create a socket descriptor
  *
  * If hostname is NULL, try to bind to port and listen. If hostname is 
- * supplied, try to connect to the host.
+ * supplied, try to connect to the host. The socket is set up according to
+ * opts, see sockopt_t.
  *
  * Returns the socket descriptor on success, or a negative value on failure.
  */
-int create_socket(const char* hostname, const char* port);
+int create_socket(const char* hostname, const char* port, sockopt_t const* opts);
+
+
+
+/* Print the effective values of the options a socket profile can set
+ *
+ * Writes one line of name=value pairs, as reported by the kernel, to stream.
+ */
+void print_sockopts(int socket_desc, FILE* stream);
+
+
+
+/* Number of bytes captured of every frame
+ *
+ * Enough for the link layer header and IPv4 and TCP headers with options,
+ * so the payload of a captured segment is usually truncated.
+ */
+#define CAPTURE_SNAPLEN 192
+
+
+
+/* Segment sniffer filter handle
+ *
+ * Captures frames through a memory-mapped AF_PACKET ring (TPACKET_V3) where
+ * the kernel hands over whole blocks of frames at a time, or through libpcap
+ * where that isn't possible.
+ */
+typedef struct capture capture_t;
+
+
+
+/* Capture statistics */
+typedef struct {
+	uint64_t packets;        // number of frames that passed the filter
+	uint64_t drops;          // number of frames dropped because the buffer was full
+	uint64_t freezes;        // number of times the ring was full (packet ring only)
+	uint64_t overruns;       // number of segments dropped because the consumer fell behind (capture thread only)
+} capstats_t;
 
 
 
@@ -89,34 +140,449 @@ int create_socket(const char* hostname, const char* port);
  *
  * Create a byte stream segment capture filter that captures segments 
  * associated with the connection (identified by socket_desc), and load the
- * handle pointer with it.
+ * handle pointer with it. Only the first CAPTURE_SNAPLEN bytes of every frame
+ * are captured.
  *
  * The timeout argument specifies how long parse_segment() should block before
- * giving up and returning 0.
+ * giving up and returning 0 (in milliseconds).
  *
  * XXX Please note that on most systems, creating a capture filter requires
  *     superuser privileges.
  *
  * Returns 0 and loads handle on success, or a negative value on failure.
  */
-int create_handle(pcap_t** handle, int socket_desc, int timeout);
+int create_handle(capture_t** handle, int socket_desc, int timeout);
 
 
 
 /* Parse a segment captured by the segment sniffer filter
  *
  * Parse a segment from the capture filter and load seg with the appropriate
- * data.
+ * data. The payload pointer of seg is valid until the next call.
  *
  * Returns 1 if successful and loads seg, returns 0 if no segment is captured
  * within a timeout period, see create_handle(), or a negative value on 
  * failure.
  */
-int parse_segment(pcap_t* handle, pkt_t* seg);
+int parse_segment(capture_t* handle, pkt_t* seg);
+
+
+
+/* Alignment of the columns of a segment batch */
+#define SEGBATCH_ALIGN 64
+
+
+
+/* Batch of captured segments
+ *
+ * Columns of header fields, one entry per segment, so that analysis loops
+ * can run over dense arrays. Every column is aligned to SEGBATCH_ALIGN.
+ */
+typedef struct {
+	size_t size;             // number of segments the columns hold
+	size_t count;            // number of segments loaded by parse_segments()
+	uint64_t* ts;            // capture time in nanoseconds
+	uint32_t* seq;           // sequence number
+	uint32_t* ack;           // acknowledgement number
+	uint16_t* win;           // window size
+	uint16_t* len;           // payload length
+	uint8_t* dir;            // 1 if sent from the local end of the connection, 0 if received
+} segbatch_t;
+
+
+
+/* Allocate the columns of a segment batch holding size segments
+ *
+ * Returns 0 on success, or a negative value on failure.
+ */
+int segbatch_init(segbatch_t* batch, size_t size);
+
+
+
+/* Free the columns of a segment batch */
+void segbatch_free(segbatch_t* batch);
+
+
+
+/* Parse a batch of segments captured by the segment sniffer filter
+ *
+ * Load batch with up to batch->size segments. Blocks for up to the timeout
+ * given to create_handle() until there is at least one frame, but never
+ * waits for more frames once it has some.
+ *
+ * Returns the number of segments loaded (also in batch->count), which is 0
+ * if no segment is captured within the timeout, or a negative value on
+ * failure.
+ */
+int parse_segments(capture_t* handle, segbatch_t* batch);
+
+
+
+/* Captured connection
+ *
+ * Segments are captured and decoded on a thread of its own, and handed over
+ * to the streamer through a lock-free single-producer/single-consumer queue,
+ * so that neither side has to wait for the other. All connections on the
+ * same device share one capture and capture thread, which hands every
+ * segment to the queue of its connection.
+ */
+typedef struct capthread capthread_t;
+
+
+
+/* Start capturing a connection
+ *
+ * Capture segments associated with the connection identified by socket_desc
+ * (see create_handle()). If no other connection is captured on the same
+ * device, a capture thread is started, pinned to core cpu unless cpu is
+ * negative.
+ *
+ * Returns 0 and loads thread on success, or a negative value on failure.
+ */
+int start_capture(capthread_t** thread, int socket_desc, int cpu);
+
+
+
+/* Take segments queued by a capture thread
+ *
+ * Load batch with up to batch->size segments in the order they were
+ * captured, without blocking. This must always be called from the same
+ * thread.
+ *
+ * Returns the number of segments loaded (also in batch->count), or a negative
+ * value if capturing has failed.
+ */
+int next_segments(capthread_t* thread, segbatch_t* batch);
+
+
+
+/* Stop capturing a connection
+ *
+ * Load stats with the capture statistics unless it is NULL, and free up the
+ * resources associated with the connection. Frames captured and dropped are
+ * counted for the whole device, overruns for the connection only. The
+ * capture thread is stopped with its last connection.
+ *
+ * Returns 0 on success, or a negative value if capturing had failed.
+ */
+int stop_capture(capthread_t* thread, capstats_t* stats);
+
+
+
+/* Get capture statistics
+ *
+ * Load stats with the number of frames captured and dropped by the kernel
+ * since the handle was created.
+ *
+ * Returns 0 and loads stats on success, or a negative value on failure.
+ */
+int capture_stats(capture_t* handle, capstats_t* stats);
+
+
+
+/* Decode a captured segment
+ *
+ * Decode the link layer, IPv4 and TCP headers of a frame captured at ts, of
+ * which caplen bytes were captured, and load seg with the appropriate data.
+ * The link type is numbered as in capture files; Ethernet (with or without
+ * VLAN tags), Linux cooked captures (v1 and v2), raw IP and BSD loopback
+ * are supported. This decodes frames the same way parse_segment() does, and
+ * it can be used directly on frames read from a capture file.
+ *
+ * Returns 1 if successful and loads seg, 0 if the frame isn't a TCP segment
+ * or is part of the connection handshake, or -1 if the link type isn't
+ * supported.
+ */
+int decode_segment(int linktype, uint8_t const* frame, uint32_t caplen, struct timeval ts, pkt_t* seg);
 
 
 
 /* Free up the resources associated with the segment sniffer handle. */
-void destroy_handle(pcap_t* handle);
+void destroy_handle(capture_t* handle);
+
+
+/* Number of sub-buckets per power of two in a histogram (precision ~6%) */
+#define HIST_SUB 16
+
+/* Total number of histogram buckets covering the 64-bit value range */
+#define HIST_BUCKETS ((64 - 3) * HIST_SUB)
+
+
+
+/* Log-bucketed histogram
+ *
+ * Records 64-bit values (e.g. delays in nanoseconds) in buckets that grow
+ * exponentially, each power of two split into HIST_SUB linear sub-buckets.
+ * Values below HIST_SUB are recorded exactly. Adding a value is O(1) and
+ * never allocates.
+ */
+typedef struct {
+	uint64_t count;                  // number of recorded values
+	uint64_t min;                    // smallest recorded value
+	uint64_t max;                    // largest recorded value
+	uint32_t buckets[HIST_BUCKETS];  // value counts per bucket
+} hist_t;
+
+
+
+/* Reset a histogram */
+void hist_init(hist_t* hist);
+
+
+
+/* Record a value in a histogram */
+void hist_add(hist_t* hist, uint64_t value);
+
+
+
+/* Add all values recorded in src to dst */
+void hist_merge(hist_t* dst, hist_t const* src);
+
+
+
+/* Find the value at percentile (0 to 100) in a histogram
+ *
+ * Returns the upper bound of the bucket holding the percentile (never more
+ * than the largest recorded value), or 0 if the histogram is empty.
+ */
+uint64_t hist_percentile(hist_t const* hist, double percentile);
+
+
+
+/* Application frame header
+ *
+ * In framing mode, every application write is prefixed with this header
+ * so that the receiver can find message boundaries in the byte stream and
+ * measure the one-way delay of each message. All fields are in network
+ * byte order. The timestamp is taken from FRAME_CLOCK, so sender and
+ * receiver clocks must be synchronised (e.g. with PTP or NTP).
+ */
+typedef struct {
+	uint32_t len;            // number of payload bytes following the header
+	uint32_t seq;            // message sequence number
+	uint64_t ts;             // send time in nanoseconds (FRAME_CLOCK)
+} frame_t;
+
+
+
+/* Clock used for frame timestamps */
+#ifndef FRAME_CLOCK
+#define FRAME_CLOCK CLOCK_REALTIME
+#endif
+
+
+
+/* Largest frame payload accepted by the receiver */
+#define FRAME_MAX (1 << 24)
+
+
+
+/* Send a framed message
+ *
+ * Prefix len bytes of buf with a frame header carrying seq and the current
+ * time, and write both to the connection in a single call. Short writes are
+ * retried until the whole frame is sent.
+ *
+ * Returns the number of payload bytes sent, or a negative value on failure.
+ */
+ssize_t send_frame(int socket_desc, void const* buf, size_t len, uint32_t seq);
+
+
+
+/* Clock used for pacing deadlines */
+#define PACE_CLOCK CLOCK_MONOTONIC
+
+
+
+/* Pacer
+ *
+ * Schedules events on absolute deadlines spaced a fixed interval apart, so
+ * that the time spent between waits doesn't make the schedule drift. The
+ * difference between the scheduled and the actual wake-up time is recorded
+ * in a histogram (nanoseconds).
+ */
+typedef struct {
+	struct timespec start;   // when the pacer was started (PACE_CLOCK)
+	struct timespec next;    // next deadline (PACE_CLOCK)
+	uint64_t interval;       // time between deadlines in nanoseconds
+	uint64_t spin;           // busy-wait this many nanoseconds before a deadline
+	uint64_t missed;         // number of deadlines skipped because we were late
+	hist_t error;            // wake-up error in nanoseconds
+} pacer_t;
+
+
+
+/* Start a pacer
+ *
+ * The first deadline is one interval from now. If spin is non-zero, the pacer
+ * sleeps until spin nanoseconds before every deadline and busy-waits the rest
+ * of the way, trading CPU time for lower wake-up error.
+ */
+void pacer_init(pacer_t* pacer, uint64_t interval, uint64_t spin);
+
+
+
+/* Wait for the next deadline
+ *
+ * Block until the next deadline, record the wake-up error and move on to the
+ * following deadline. If one or more deadlines have already passed by more
+ * than an interval, they are skipped rather than sent in a burst.
+ *
+ * Returns the number of skipped deadlines, or a negative value on failure.
+ */
+int pacer_wait(pacer_t* pacer);
+
+
+
+/* Wait until offset nanoseconds after the pacer was started
+ *
+ * Block until the deadline and record the wake-up error, for schedules that
+ * aren't evenly spaced. Deadlines that have already passed return at once.
+ *
+ * Returns 0 on success, or a negative value on failure.
+ */
+int pacer_wait_at(pacer_t* pacer, uint64_t offset);
+
+
+
+/* Congestion state sample
+ *
+ * A snapshot of the kernel's view of a connection, taken with TCP_INFO. No
+ * packet capture (and so no superuser privileges) is needed.
+ */
+typedef struct {
+	uint64_t ts;             // time since the sampler was started (ns)
+	uint32_t srtt;           // smoothed round-trip time (us)
+	uint32_t rttvar;         // round-trip time variation (us)
+	uint32_t cwnd;           // congestion window (segments)
+	uint32_t ssthresh;       // slow start threshold (segments)
+	uint32_t retrans;        // total number of retransmitted segments
+	uint32_t unacked;        // segments sent but not acknowledged
+	uint32_t lost;           // segments presumed lost
+	uint64_t delivery_rate;  // most recent delivery rate estimate (bytes/s)
+} tcpinfo_t;
+
+
+
+/* Congestion state sampler
+ *
+ * Samples a connection at a fixed rate into a preallocated ring of samples.
+ * When the ring is full, the oldest samples are overwritten.
+ */
+typedef struct {
+	int sock;                // connection to sample
+	uint64_t start;          // when the sampler was started (PACE_CLOCK, ns)
+	uint64_t interval;       // minimum time between samples (ns)
+	uint64_t next;           // earliest time of the next sample (ns since start)
+	uint64_t count;          // number of samples taken
+	size_t size;             // number of samples the ring holds
+	tcpinfo_t* samples;      // sample ring
+} sampler_t;
+
+
+
+/* Start a sampler
+ *
+ * Allocate a ring of size samples for the connection identified by
+ * socket_desc. An interval of 0 means that every call to sampler_poll()
+ * takes a sample, e.g. after every send.
+ *
+ * Returns 0 on success, or a negative value on failure.
+ */
+int sampler_init(sampler_t* sampler, int socket_desc, size_t size, uint64_t interval);
+
+
+
+/* Take a sample if the interval has passed since the last one
+ *
+ * Returns 1 if a sample was taken, 0 if it isn't time yet, or a negative
+ * value on failure.
+ */
+int sampler_poll(sampler_t* sampler);
+
+
+
+/* Write the samples in the ring to a stream as a time series
+ *
+ * One line per sample, oldest first, with a header line naming the columns.
+ */
+void sampler_dump(sampler_t const* sampler, FILE* stream);
+
+
+
+/* Free up the resources associated with a sampler. */
+void sampler_free(sampler_t* sampler);
+
+
+
+/* Segment timed by an RTT tracker */
+typedef struct {
+	uint64_t end;            // extended sequence number following the segment
+	uint64_t ts;             // when the segment was sent (ns)
+	uint32_t len;            // number of payload bytes
+	uint32_t retransmitted;  // (part of) the segment was sent more than once
+} rttseg_t;
+
+
+
+/* Round-trip time tracker
+ *
+ * Times every data segment sent in one direction of a connection. Sequence
+ * numbers are extended to 64 bits, so that they compare correctly across
+ * wraparound, and outstanding segments are kept in sequence order in a
+ * preallocated ring. A cumulative acknowledgement yields one sample for
+ * every segment it covers entirely, unless it covers a segment that was sent
+ * more than once, as the acknowledgement can't be matched to either copy
+ * (Karn's algorithm). Segments sent while the ring is full aren't timed.
+ */
+typedef struct {
+	int started;             // a segment has been sent
+	uint64_t snd_una;        // oldest unacknowledged sequence number (extended)
+	uint64_t snd_max;        // sequence number following the highest sent (extended)
+	size_t size;             // number of segments the ring holds (a power of two)
+	size_t head;             // number of segments removed from the ring
+	size_t tail;             // number of segments added to the ring
+	rttseg_t* segs;          // outstanding segments
+	uint64_t samples;        // number of samples taken
+	uint64_t karn;           // number of segments acknowledged without a sample
+	uint64_t untimed;        // number of segments sent while the ring was full
+} rtt_t;
+
+
+
+/* Start an RTT tracker
+ *
+ * Allocate a ring timing up to size outstanding segments (rounded up to a
+ * power of two).
+ *
+ * Returns 0 on success, or a negative value on failure.
+ */
+int rtt_init(rtt_t* rtt, size_t size);
+
+
+
+/* Record a segment with len payload bytes starting at seq, sent at ts (ns)
+ *
+ * Returns 1 if (part of) the segment was sent before, or 0 otherwise.
+ */
+int rtt_sent(rtt_t* rtt, uint32_t seq, uint32_t len, uint64_t ts);
+
+
+
+/* Record an acknowledgement of everything before ack, received at ts (ns)
+ *
+ * Load samples with the RTT (ns) of up to n segments the acknowledgement
+ * covers, oldest first; any further segments are acknowledged without a
+ * sample. Duplicate and old acknowledgements, and acknowledgements of data
+ * that hasn't been seen sent, yield nothing.
+ *
+ * Returns the number of samples loaded.
+ */
+size_t rtt_acked(rtt_t* rtt, uint32_t ack, uint64_t ts, uint64_t* samples, size_t n);
+
+
+
+/* Free up the resources associated with an RTT tracker. */
+void rtt_free(rtt_t* rtt);
 
 #endif
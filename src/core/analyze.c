@@ -0,0 +1,463 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <byteswap.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+#include "analyze.h"
+#include "capture.h"
+#include "flowtable.h"
+#include "utils.h"
+
+
+/* Magic numbers of the pcap file format (microsecond and nanosecond timestamps) */
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+
+/* Number of flows a flow table starts out with */
+#define INITIAL_FLOWS 256
+
+/* Number of frames decoded at a time, between reading the clock */
+#define DECODE_BATCH 256
+
+/* Number of duplicate acknowledgements that make a dupACK event */
+#define DUPACK_THRESHOLD 3
+
+/* Number of outstanding segments timed per direction */
+#define RTT_WINDOW 1024
+
+/* Largest number of RTT samples taken from one acknowledgement */
+#define RTT_PER_ACK 64
+
+
+
+/* pcap file header */
+struct file_hdr
+{
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+
+
+/* pcap record header */
+struct record_hdr
+{
+	uint32_t ts_sec;
+	uint32_t ts_frac;        // microseconds or nanoseconds, see the magic number
+	uint32_t caplen;
+	uint32_t len;
+};
+
+
+
+/* State of one direction of a flow, named after the endpoint sending */
+struct half
+{
+	int sending;             // has sent data
+	uint64_t segments;       // number of data segments
+	uint64_t bytes;          // number of payload bytes
+	uint64_t retrans;        // number of retransmitted data segments
+	uint64_t retrans_bytes;  // number of retransmitted payload bytes
+	rtt_t timer;             // times the data segments (allocated when data is first sent)
+	hist_t rtt;              // RTT samples (ns)
+	int acking;              // has acknowledged data
+	uint32_t ack_hi;         // highest acknowledgement number sent
+	unsigned dupacks;        // number of duplicates of ack_hi
+	uint64_t dupack_events;  // number of times dupacks reached DUPACK_THRESHOLD
+};
+
+
+
+/* Flow state */
+struct flow
+{
+	unsigned id;             // flow number within the work item
+	struct half half[2];     // state per sending endpoint
+};
+
+
+
+/* A file, or part of the flows of a file, analysed by one thread */
+struct item
+{
+	char const *file;
+	unsigned part;           // process flows with hash % parts == part
+	unsigned parts;
+};
+
+
+
+/* Shared state of the analysis threads */
+struct analysis
+{
+	struct item *items;
+	unsigned n;
+	unsigned next;           // next item to take
+	int status;
+	uint64_t frames;         // number of frames read
+	uint64_t bytes;          // number of bytes read
+	pthread_mutex_t output;  // serialises reports
+};
+
+
+
+/* Is sequence number a before b (modulo 2^32) */
+static int before(uint32_t a, uint32_t b)
+{
+	return (int32_t) (a - b) < 0;
+}
+
+
+
+/* Print a timestamp and flow number leading an event line */
+static void print_event(FILE *out, uint64_t ts, struct flow const *flow)
+{
+	fprintf(out, "%" PRIu64 ".%06" PRIu64 " %u ", ts / 1000000000, ts % 1000000000 / 1000, flow->id);
+}
+
+
+
+/* Account a segment sent by endpoint side of a flow */
+static int add_segment(FILE *out, struct flow *flow, int side, struct headers const *seg, uint64_t ts)
+{
+	struct half *snd = &flow->half[side], *rcv = &flow->half[!side];
+	uint64_t rtts[RTT_PER_ACK];
+	size_t i, n;
+
+	/* Data sent */
+	if (seg->len > 0) {
+		if (!snd->sending && rtt_init(&snd->timer, RTT_WINDOW) < 0)
+			return -1;
+		snd->sending = 1;
+
+		++snd->segments;
+		snd->bytes += seg->len;
+
+		if (rtt_sent(&snd->timer, seg->seq, seg->len, ts)) {
+			++snd->retrans;
+			snd->retrans_bytes += seg->len;
+		}
+	}
+
+	/* Data acknowledged, every segment covered is a sample */
+	n = rcv->sending ? rtt_acked(&rcv->timer, seg->ack, ts, rtts, RTT_PER_ACK) : 0;
+	for (i = 0; i < n; ++i) {
+		hist_add(&rcv->rtt, rtts[i]);
+		print_event(out, ts, flow);
+		fprintf(out, "rtt %.3lf ms\n", rtts[i] / 1e6);
+	}
+
+	if (!snd->acking || before(snd->ack_hi, seg->ack)) {
+		snd->ack_hi = seg->ack;
+		snd->acking = 1;
+		snd->dupacks = 0;
+	} else if (seg->len == 0 && seg->ack == snd->ack_hi && ++snd->dupacks == DUPACK_THRESHOLD) {
+		++snd->dupack_events;
+		print_event(out, ts, flow);
+		fprintf(out, "dupack %u\n", snd->ack_hi);
+	}
+
+	return 0;
+}
+
+
+
+/* Print the statistics of one direction of a flow */
+static void report_half(FILE *out, struct flow const *flow, struct flow_key const *key, int side)
+{
+	struct half const *h = &flow->half[side];
+	char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
+
+	inet_ntop(AF_INET, &key->addr[side], src, sizeof(src));
+	inet_ntop(AF_INET, &key->addr[!side], dst, sizeof(dst));
+
+	fprintf(out, "# flow %u %s:%u -> %s:%u: %" PRIu64 " segments (%" PRIu64 " bytes), "
+			"%" PRIu64 " retransmitted (%" PRIu64 " bytes), %" PRIu64 " dupACK events",
+			flow->id, src, ntohs(key->port[side]), dst, ntohs(key->port[!side]),
+			h->segments, h->bytes, h->retrans, h->retrans_bytes, flow->half[!side].dupack_events);
+
+	if (h->rtt.count > 0)
+		fprintf(out, ", RTT p50 %.3lf ms, p99 %.3lf ms, max %.3lf ms (%" PRIu64 " samples)",
+				hist_percentile(&h->rtt, 50.0) / 1e6, hist_percentile(&h->rtt, 99.0) / 1e6,
+				h->rtt.max / 1e6, h->rtt.count);
+	fprintf(out, "\n");
+}
+
+
+
+/* Get the record at pos of a capture file and advance pos past it
+ *
+ * Returns the frame and loads rh, or NULL at the end of the file.
+ */
+static uint8_t const* next_record(uint8_t const *data, size_t size, size_t *pos, int swapped, struct record_hdr *rh)
+{
+	uint8_t const *frame;
+
+	if (*pos + sizeof(struct record_hdr) > size)
+		return NULL;
+
+	memcpy(rh, data + *pos, sizeof(struct record_hdr));
+	if (swapped) {
+		rh->ts_sec = bswap_32(rh->ts_sec);
+		rh->ts_frac = bswap_32(rh->ts_frac);
+		rh->caplen = bswap_32(rh->caplen);
+		rh->len = bswap_32(rh->len);
+	}
+
+	if (*pos + sizeof(struct record_hdr) + rh->caplen > size)
+		return NULL; // truncated capture
+
+	frame = data + *pos + sizeof(struct record_hdr);
+	*pos += sizeof(struct record_hdr) + rh->caplen;
+	return frame;
+}
+
+
+
+/* Analyse the flows of a memory-mapped capture file that belong to an item */
+static int analyze_trace(FILE *out, uint8_t const *data, size_t size, struct item const *item, uint64_t *frames)
+{
+	struct file_hdr const *fh = (struct file_hdr const*) data;
+	struct record_hdr rh;
+	struct headers segs[DECODE_BATCH];
+	uint64_t ts[DECODE_BATCH];
+	struct flowtable table;
+	struct flow_key key;
+	struct flow *flow;
+	struct timespec start, end;
+	uint8_t const *frame;
+	decoder_t decode;
+	char const *name;
+	size_t pos = sizeof(struct file_hdr), i;
+	uint64_t decoded = 0, read = 0, ns = 0;
+	unsigned flows = 0;
+	int swapped, nsec, side, linktype, j, n, status = 0;
+
+	if (size < sizeof(struct file_hdr))
+		return -1;
+
+	swapped = fh->magic == bswap_32(PCAP_MAGIC_US) || fh->magic == bswap_32(PCAP_MAGIC_NS);
+	nsec = fh->magic == PCAP_MAGIC_NS || fh->magic == bswap_32(PCAP_MAGIC_NS);
+	if (!swapped && fh->magic != PCAP_MAGIC_US && fh->magic != PCAP_MAGIC_NS)
+		return -1;
+
+	// the decoder is chosen once per file
+	linktype = swapped ? bswap_32(fh->linktype) : fh->linktype;
+	if ((decode = find_decoder(linktype, &name)) == NULL) {
+		fprintf(stderr, "%s: Captures of link type %d can't be analysed\n", item->file, linktype);
+		return -1;
+	}
+
+	if (create_flowtable(&table, INITIAL_FLOWS, sizeof(struct flow)) < 0)
+		return -1;
+
+	do {
+		/* Decode a batch of frames, timing the decoder without reading the clock per frame */
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (n = 0; n < DECODE_BATCH && (frame = next_record(data, size, &pos, swapped, &rh)) != NULL; ++read) {
+			if (decode(frame, rh.caplen, &segs[n]) == 1)
+				ts[n++] = rh.ts_sec * 1000000000ULL + (nsec ? rh.ts_frac : rh.ts_frac * 1000ULL);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ns += (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+		decoded += n;
+
+		/* Hand the segments to their flows */
+		for (j = 0; j < n; ++j) {
+			side = make_key(&key, segs[j].saddr, segs[j].sport, segs[j].daddr, segs[j].dport);
+			if (item->parts > 1 && hash_key(&key) % item->parts != item->part)
+				continue;
+
+			if ((flow = lookup_flow(&table, &key, 1)) == NULL) {
+				status = -1;
+				break;
+			}
+			if (flow->id == 0)
+				flow->id = ++flows;
+
+			if (add_segment(out, flow, side, &segs[j], ts[j]) < 0) {
+				status = -1;
+				break;
+			}
+		}
+	} while (frame != NULL && status == 0);
+
+	*frames += read;
+	if (item->part == 0)
+		fprintf(out, "# decoded %" PRIu64 " TCP segments from %" PRIu64 " %s frames, %.1lf ns per frame\n",
+				decoded, read, name, read > 0 ? (double) ns / read : 0.0);
+
+	/* Summarise every direction that carried data */
+	for (i = 0; i < table.capacity; ++i) {
+		if ((flow = flow_slot(&table, i)) == NULL)
+			continue;
+
+		for (side = 0; side < 2; ++side) {
+			if (flow->half[side].sending && status == 0)
+				report_half(out, flow, &table.keys[i], side);
+			rtt_free(&flow->half[side].timer);
+		}
+	}
+
+	destroy_flowtable(&table);
+	return status;
+}
+
+
+
+/* Map a capture file and analyse it, buffering the report */
+static int analyze_item(struct item const *item, char **report, size_t *len, uint64_t *frames, uint64_t *bytes)
+{
+	struct stat st;
+	void *data;
+	FILE *out;
+	uint64_t read = 0;
+	int fd, status;
+
+	if ((fd = open(item->file, O_RDONLY)) == -1)
+		return -1;
+
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+
+	if ((data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	if ((out = open_memstream(report, len)) == NULL) {
+		munmap(data, st.st_size);
+		return -1;
+	}
+
+	if (item->parts > 1)
+		fprintf(out, "# trace %s (flows %u of %u)\n", item->file, item->part + 1, item->parts);
+	else
+		fprintf(out, "# trace %s\n", item->file);
+
+	// every part reads the whole file, count it once
+	status = analyze_trace(out, data, st.st_size, item, &read);
+	if (item->part == 0) {
+		*frames += read;
+		*bytes += st.st_size;
+	}
+
+	fclose(out);
+	munmap(data, st.st_size);
+	return status;
+}
+
+
+
+/* Take items until there are none left */
+static void* analysis_thread(struct analysis *a)
+{
+	char *report;
+	size_t len;
+	unsigned i;
+	uint64_t frames = 0, bytes = 0;
+
+	while ((i = __atomic_fetch_add(&a->next, 1, __ATOMIC_RELAXED)) < a->n) {
+		report = NULL;
+		len = 0;
+
+		if (analyze_item(&a->items[i], &report, &len, &frames, &bytes) < 0) {
+			fprintf(stderr, "Unable to analyse trace: %s\n", a->items[i].file);
+			__atomic_store_n(&a->status, -1, __ATOMIC_RELAXED);
+		}
+
+		// reports are written whole, so that items don't interleave
+		if (report != NULL) {
+			pthread_mutex_lock(&a->output);
+			fwrite(report, 1, len, stdout);
+			pthread_mutex_unlock(&a->output);
+			free(report);
+		}
+	}
+
+	__atomic_add_fetch(&a->frames, frames, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&a->bytes, bytes, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+
+
+/* Analyse capture files */
+int analyze(char **files, int n, unsigned threads)
+{
+	struct analysis a;
+	pthread_t *tids;
+	struct timespec start, end;
+	unsigned i, k, parts, started;
+	double secs;
+
+	if (n <= 0) {
+		fprintf(stderr, "No traces to analyse\n");
+		return -1;
+	}
+
+	if (threads == 0) {
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = ncpus > 0 ? ncpus : 1;
+	}
+
+	/* Split the flows of every file between threads if there are threads to spare */
+	parts = threads > (unsigned) n ? threads / n : 1;
+
+	memset(&a, 0, sizeof(a));
+	a.n = n * parts;
+	if ((a.items = malloc(sizeof(struct item) * a.n)) == NULL
+			|| (tids = malloc(sizeof(pthread_t) * threads)) == NULL) {
+		free(a.items);
+		return -1;
+	}
+
+	for (i = 0; i < (unsigned) n; ++i) {
+		for (k = 0; k < parts; ++k) {
+			a.items[i * parts + k].file = files[i];
+			a.items[i * parts + k].part = k;
+			a.items[i * parts + k].parts = parts;
+		}
+	}
+	pthread_mutex_init(&a.output, NULL);
+
+	/* Run analysis threads, the calling thread is one of them */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (started = 1; started < threads && started < a.n; ++started) {
+		if (pthread_create(&tids[started], NULL, (void* (*)(void*)) &analysis_thread, &a) != 0)
+			break;
+	}
+	analysis_thread(&a);
+
+	for (i = 1; i < started; ++i)
+		pthread_join(tids[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stdout, "Analysed %" PRIu64 " frames (%.1lf MB) from %d traces in %.2lf seconds using %u threads\n",
+			a.frames, a.bytes / 1e6, n, secs, started);
+
+	pthread_mutex_destroy(&a.output);
+	free(tids);
+	free(a.items);
+	return a.status;
+}
@@ -0,0 +1,16 @@
+#ifndef __ANALYZE__
+#define __ANALYZE__
+
+
+/* Analyse capture files
+ *
+ * Read the pcap files named in files and report, for every TCP flow, RTT
+ * samples, dupACK events and retransmission statistics on stdout. The files
+ * are processed by up to threads threads (0 means one per core); if there are
+ * fewer files than threads, the flows of a file are split between threads.
+ *
+ * Returns 0 on success, or a negative value if a file couldn't be analysed.
+ */
+int analyze(char **files, int n, unsigned threads);
+
+#endif
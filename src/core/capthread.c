@@ -0,0 +1,418 @@
+#define _GNU_SOURCE
+#include <net/if.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <sched.h>
+#include <pthread.h>
+#include "utils.h"
+#include "capture.h"
+#include "flowtable.h"
+#include "ring.h"
+
+
+/* How long the capture thread waits for frames before checking if it should stop (ms) */
+#define CAPTURE_POLL 50
+
+/* Number of segments the ring between the threads holds */
+#define CAPTURE_QUEUE 65536
+
+/* Number of segments decoded by the capture thread between demultiplexing rounds */
+#define CAPTURE_BATCH 256
+
+/* Maximum length of the filter expression of a connection */
+#define CAPTURE_EXPR_LEN 256
+
+/* Number of connections above which the filter lets all TCP segments through */
+#define CAPTURE_MAX_FILTERS 64
+
+
+
+/* Segment record passed through the ring */
+struct record
+{
+	uint64_t ts;
+	uint32_t seq;
+	uint32_t ack;
+	uint16_t win;
+	uint16_t len;
+	uint8_t dir;
+};
+
+
+
+/* Capture of a device, shared by every connection on it */
+struct shared
+{
+	struct shared *next;     // next capture in the list
+	char dev[IF_NAMESIZE];   // device captured on
+	unsigned users;          // connections holding on to the capture (guarded by the list lock)
+	capture_t *handle;       // capture handle, only used by the capture thread
+	pthread_t thread;        // capture thread
+	pthread_mutex_t lock;    // guards the flow table, filter updates and statistics
+	struct flowtable flows;  // connections captured (flow key to struct capthread*)
+	pthread_cond_t updated;  // signalled when the filter has been updated
+	unsigned wanted;         // incremented when the filter must be updated
+	unsigned applied;        // the value of wanted when the filter was last updated
+	int run;                 // cleared to stop the capture thread
+	int status;              // set if capture failed
+	capstats_t stats;        // capture statistics, gathered when the filter is updated
+};
+
+
+
+/* Captured connection, see capthread_t */
+struct capthread
+{
+	struct shared *shared;   // capture of the device
+	struct flow_key key;     // 4-tuple of the connection
+	int side;                // endpoint of the key that is the local end
+	char expr[CAPTURE_EXPR_LEN]; // filter expression of the connection
+	struct ring *ring;       // decoded segments on their way to the consumer
+	uint64_t overruns;       // segments dropped because the ring was full
+};
+
+
+
+/* Captures in use, every device has its own lock for the rest of its state */
+static struct shared *captures = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/* Filter on the connections in the flow table
+ *
+ * Called with the lock of the capture held, which is dropped while the filter
+ * is compiled and set, so that connections can come and go in the meantime.
+ */
+static void update_filter(struct shared *sc)
+{
+	char expr[CAPTURE_FILTER_LEN];
+	struct capthread **ct;
+	capstats_t stats;
+	size_t i, n, len;
+	unsigned wanted = sc->wanted;
+
+	len = 0;
+	n = 0;
+	if (sc->flows.count <= CAPTURE_MAX_FILTERS) {
+		len = snprintf(expr, sizeof(expr), "tcp and (");
+		for (i = 0; i < sc->flows.capacity && len < sizeof(expr); ++i)
+			if ((ct = flow_slot(&sc->flows, i)) != NULL)
+				len += snprintf(expr + len, sizeof(expr) - len, "%s(%s)", n++ > 0 ? " or " : "", (*ct)->expr);
+
+		if (len < sizeof(expr))
+			len += snprintf(expr + len, sizeof(expr) - len, ")");
+	}
+	pthread_mutex_unlock(&sc->lock);
+
+	// too many connections to filter on, sort them out when demultiplexing
+	if (n == 0 || len >= sizeof(expr) || set_filter(sc->handle, expr) < 0)
+		set_filter(sc->handle, "tcp");
+
+	// the handle is only used by the capture thread, so the statistics are handed over here
+	memset(&stats, 0, sizeof(stats));
+	capture_stats(sc->handle, &stats);
+
+	pthread_mutex_lock(&sc->lock);
+	sc->stats = stats;
+	sc->applied = wanted;
+	pthread_cond_broadcast(&sc->updated);
+}
+
+
+
+/* Capture segments and queue them for their connections */
+static void* capture_loop(struct shared *sc)
+{
+	struct captured frame;
+	struct headers hdrs[CAPTURE_BATCH];
+	uint64_t ts[CAPTURE_BATCH];
+	struct flow_key key;
+	struct capthread **ct;
+	struct record rec;
+	int i, n, side, status = 0;
+
+	while (__atomic_load_n(&sc->run, __ATOMIC_RELAXED)) {
+
+		/* Decode a batch of segments, only waiting while it is empty */
+		for (n = 0; n < CAPTURE_BATCH; ) {
+			if ((status = capture_frame(sc->handle, n == 0, &frame)) <= 0)
+				break;
+
+			if (sc->handle->decode(frame.data, frame.caplen, &hdrs[n]))
+				ts[n++] = frame.ts;
+		}
+
+		/* Hand every segment to its connection */
+		pthread_mutex_lock(&sc->lock);
+		for (i = 0; i < n; ++i) {
+			side = make_key(&key, hdrs[i].saddr, hdrs[i].sport, hdrs[i].daddr, hdrs[i].dport);
+			if ((ct = lookup_flow(&sc->flows, &key, 0)) == NULL)
+				continue;
+
+			rec.ts = ts[i];
+			rec.seq = hdrs[i].seq;
+			rec.ack = hdrs[i].ack;
+			rec.win = hdrs[i].win;
+			rec.len = hdrs[i].len;
+			rec.dir = side == (*ct)->side;
+
+			// never wait for the consumer, the capture must keep up with the kernel
+			if (ring_push((*ct)->ring, &rec) < 0)
+				__atomic_add_fetch(&(*ct)->overruns, 1, __ATOMIC_RELAXED);
+		}
+
+		if (status < 0) {
+			__atomic_store_n(&sc->status, -1, __ATOMIC_RELAXED);
+			pthread_cond_broadcast(&sc->updated);
+			pthread_mutex_unlock(&sc->lock);
+			break;
+		}
+
+		if (sc->applied != sc->wanted)
+			update_filter(sc);
+		pthread_mutex_unlock(&sc->lock);
+	}
+
+	return NULL;
+}
+
+
+
+/* Set up the capture of a device for its first connection (called with the lock held) */
+static struct shared* create_shared(char const *dev, struct capthread *ct, int cpu)
+{
+	struct shared *sc;
+	pthread_attr_t attr;
+	cpu_set_t cpus;
+	char expr[CAPTURE_EXPR_LEN + 16];
+	int status;
+
+	if ((sc = calloc(1, sizeof(struct shared))) == NULL)
+		return NULL;
+	snprintf(sc->dev, sizeof(sc->dev), "%s", dev);
+	sc->users = 1;
+
+	if (create_flowtable(&sc->flows, CAPTURE_MAX_FILTERS, sizeof(struct capthread*)) < 0) {
+		free(sc);
+		return NULL;
+	}
+	*((struct capthread**) lookup_flow(&sc->flows, &ct->key, 1)) = ct;
+
+	snprintf(expr, sizeof(expr), "tcp and (%s)", ct->expr);
+	if (open_capture(&sc->handle, dev, expr, CAPTURE_POLL) < 0) {
+		destroy_flowtable(&sc->flows);
+		free(sc);
+		return NULL;
+	}
+
+	pthread_mutex_init(&sc->lock, NULL);
+	pthread_cond_init(&sc->updated, NULL);
+	pthread_attr_init(&attr);
+	if (cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+	}
+
+	sc->run = 1;
+	if ((status = pthread_create(&sc->thread, &attr, (void* (*)(void*)) &capture_loop, sc)) != 0) {
+		fprintf(stderr, "Unable to start capture thread: %s\n", strerror(status));
+		pthread_attr_destroy(&attr);
+		pthread_cond_destroy(&sc->updated);
+		pthread_mutex_destroy(&sc->lock);
+		destroy_handle(sc->handle);
+		destroy_flowtable(&sc->flows);
+		free(sc);
+		return NULL;
+	}
+	pthread_attr_destroy(&attr);
+
+	sc->next = captures;
+	captures = sc;
+	return sc;
+}
+
+
+
+/* Stop the capture thread and free the capture of a device
+ *
+ * Load stats with the final capture statistics unless it is NULL.
+ */
+static int destroy_shared(struct shared *sc, capstats_t *stats)
+{
+	int status;
+
+	__atomic_store_n(&sc->run, 0, __ATOMIC_RELAXED);
+	pthread_join(sc->thread, NULL);
+
+	// the capture thread is gone, so the handle can be used here
+	if (stats != NULL && capture_stats(sc->handle, stats) < 0)
+		*stats = sc->stats;
+	status = sc->status;
+
+	pthread_cond_destroy(&sc->updated);
+	pthread_mutex_destroy(&sc->lock);
+	destroy_handle(sc->handle);
+	destroy_flowtable(&sc->flows);
+	free(sc);
+	return status;
+}
+
+
+
+/* Let go of the capture of a device, stopping it with its last user
+ *
+ * Load stats with the final capture statistics if it was the last user.
+ */
+static int release_shared(struct shared *sc, capstats_t *stats)
+{
+	struct shared **ptr;
+	int last;
+
+	pthread_mutex_lock(&lock);
+	if ((last = --sc->users == 0)) {
+		for (ptr = &captures; *ptr != sc; ptr = &(*ptr)->next);
+		*ptr = sc->next;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return last ? destroy_shared(sc, stats) : 0;
+}
+
+
+
+/* Start capturing a connection */
+int start_capture(capthread_t **thread, int sock, int cpu)
+{
+	struct capthread *ct, **slot;
+	struct shared *sc;
+	struct sockaddr_in local, remote;
+	char dev[IF_NAMESIZE];
+	unsigned wanted;
+	int status = 0;
+
+	if ((ct = calloc(1, sizeof(struct capthread))) == NULL)
+		return -1;
+
+	if (lookup_dev(sock, dev, sizeof(dev)) || lookup_addr(sock, &local, &remote) < 0) {
+		free(ct);
+		return -1;
+	}
+
+	if (conn_filter(sock, ct->expr, sizeof(ct->expr)) < 0) {
+		free(ct);
+		return -3;
+	}
+	ct->side = make_key(&ct->key, local.sin_addr.s_addr, local.sin_port, remote.sin_addr.s_addr, remote.sin_port);
+
+	if ((ct->ring = ring_create(CAPTURE_QUEUE, sizeof(struct record))) == NULL) {
+		free(ct);
+		return -1;
+	}
+
+	pthread_mutex_lock(&lock);
+	for (sc = captures; sc != NULL && strcmp(sc->dev, dev) != 0; sc = sc->next);
+
+	if (sc == NULL) {
+		if ((ct->shared = create_shared(dev, ct, cpu)) == NULL)
+			status = -2;
+		pthread_mutex_unlock(&lock);
+
+	} else {
+		// holding on to the capture keeps it from being stopped before the connection is added
+		++sc->users;
+		pthread_mutex_unlock(&lock);
+
+		pthread_mutex_lock(&sc->lock);
+		if ((slot = lookup_flow(&sc->flows, &ct->key, 1)) == NULL) {
+			status = -1;
+
+		} else {
+			/* Wait for the capture thread to let the segments of the connection through */
+			*slot = ct;
+			ct->shared = sc;
+			wanted = ++sc->wanted;
+			while ((int) (sc->applied - wanted) < 0 && sc->status == 0)
+				pthread_cond_wait(&sc->updated, &sc->lock);
+			status = sc->status;
+
+			if (status < 0)
+				remove_flow(&sc->flows, &ct->key);
+		}
+		pthread_mutex_unlock(&sc->lock);
+
+		if (status < 0)
+			release_shared(sc, NULL);
+	}
+
+	if (status < 0) {
+		ring_destroy(ct->ring);
+		free(ct);
+		return status;
+	}
+
+	*thread = ct;
+	return 0;
+}
+
+
+
+/* Take the segments the capture thread has queued */
+int next_segments(capthread_t *ct, segbatch_t *batch)
+{
+	struct record rec;
+
+	for (batch->count = 0; batch->count < batch->size && ring_pop(ct->ring, &rec); ++batch->count) {
+		batch->ts[batch->count] = rec.ts;
+		batch->seq[batch->count] = rec.seq;
+		batch->ack[batch->count] = rec.ack;
+		batch->win[batch->count] = rec.win;
+		batch->len[batch->count] = rec.len;
+		batch->dir[batch->count] = rec.dir;
+	}
+
+	if (batch->count == 0 && __atomic_load_n(&ct->shared->status, __ATOMIC_RELAXED) < 0)
+		return -1;
+
+	return batch->count;
+}
+
+
+
+/* Stop capturing a connection */
+int stop_capture(capthread_t *ct, capstats_t *stats)
+{
+	struct shared *sc = ct->shared;
+	unsigned wanted;
+	int status;
+
+	pthread_mutex_lock(&sc->lock);
+	remove_flow(&sc->flows, &ct->key);
+
+	/* Wait for the capture thread to update the filter and gather the statistics */
+	if (sc->flows.count > 0) {
+		wanted = ++sc->wanted;
+		while ((int) (sc->applied - wanted) < 0 && sc->status == 0)
+			pthread_cond_wait(&sc->updated, &sc->lock);
+	}
+
+	if (stats != NULL)
+		*stats = sc->stats;
+	status = sc->status;
+	pthread_mutex_unlock(&sc->lock);
+
+	// the last user stops the capture thread and reads the final statistics
+	if (release_shared(sc, stats) < 0)
+		status = -1;
+
+	// the capture thread no longer pushes to the ring of the connection
+	if (stats != NULL)
+		stats->overruns = ct->overruns;
+
+	ring_destroy(ct->ring);
+	free(ct);
+	return status;
+}
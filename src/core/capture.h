@@ -0,0 +1,192 @@
+#ifndef __CAPTURE__
+#define __CAPTURE__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pcap.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include "utils.h"
+
+
+/* Size of a packet ring block (the unit handed over by the kernel) */
+#define CAPTURE_BLOCK_SIZE (1 << 18)
+
+/* Number of packet ring blocks */
+#define CAPTURE_BLOCKS 32
+
+/* Packet ring frame size (only used by the kernel to size the ring) */
+#define CAPTURE_FRAME_SIZE 2048
+
+/* Link types as numbered in capture files, pcap_datalink() agrees except
+ * for raw IP (DLT_RAW) */
+#define LINK_NULL 0
+#define LINK_ETHERNET 1
+#define LINK_RAW 101
+#define LINK_LOOP 108
+#define LINK_SLL 113
+#define LINK_IPV4 228
+#define LINK_SLL2 276
+
+/* Maximum length of a capture filter expression */
+#define CAPTURE_FILTER_LEN 16384
+
+
+
+/* Decoded TCP/IPv4 headers, addresses and ports in network byte order */
+struct headers
+{
+	uint32_t saddr;          // source address
+	uint32_t daddr;          // destination address
+	uint16_t sport;          // source port
+	uint16_t dport;          // destination port
+	uint32_t seq;            // sequence number
+	uint32_t ack;            // acknowledgement number
+	uint16_t win;            // window size
+	uint16_t len;            // payload length
+	uint8_t const *payload;  // payload (truncated to the captured bytes)
+};
+
+
+
+/* Frame decoder, specialised for a link type
+ *
+ * Decode the link layer, IPv4 and TCP headers of a frame of which caplen
+ * bytes were captured, never reading past them.
+ *
+ * Returns 1 and loads hdrs if the frame is a TCP segment that isn't part of
+ * the connection handshake, or 0 otherwise.
+ */
+typedef int (*decoder_t)(uint8_t const *frame, uint32_t caplen, struct headers *hdrs);
+
+
+
+/* Segment sniffer filter handle (see capture_t) */
+struct capture
+{
+	enum { CAPTURE_RING, CAPTURE_PCAP } backend;
+	int timeout;             // how long to wait for a segment (ms)
+	char dev[IF_NAMESIZE];   // device captured on
+	int linktype;            // link type of the captured frames
+	decoder_t decode;        // decoder for the link type
+	pcap_t *pcap;            // libpcap handle (pcap backend)
+	int nonblock;            // the libpcap handle doesn't wait for frames
+	struct sockaddr_in local; // local end of the captured connection
+	int fd;                  // packet socket (ring backend)
+	int loopback;            // capturing on a loopback device, where frames are seen twice
+	uint8_t *ring;           // memory-mapped packet ring
+	unsigned block;          // index of the current block
+	unsigned left;           // number of frames left in the current block (0 if none is held)
+	struct tpacket3_hdr *next; // next frame in the current block
+	capstats_t stats;        // accumulated statistics (ring backend)
+};
+
+
+
+/* Captured frame, valid until the next frame is fetched */
+struct captured
+{
+	uint8_t const *data;     // link layer header onwards
+	uint32_t caplen;         // number of bytes captured
+	uint32_t wirelen;        // number of bytes on the wire
+	uint64_t ts;             // capture time (ns)
+};
+
+
+
+/* Find the decoder of a link type
+ *
+ * Load name with the name of the link type unless it is NULL.
+ *
+ * Returns the decoder, or NULL if the link type isn't supported.
+ */
+decoder_t find_decoder(int linktype, char const **name);
+
+
+
+/* Write the filter expression matching the segments of a connection
+ *
+ * The expression matches both directions of the connection sock, but not
+ * the protocol, so several expressions can be joined by "or" under a single
+ * "tcp and".
+ *
+ * Returns 0 on success, or a negative value on failure.
+ */
+int conn_filter(int sock, char *expr, size_t len);
+
+
+
+/* Open a capture handle on a device
+ *
+ * Capture the frames on device dev matching the filter expression expr,
+ * waiting up to timeout milliseconds for frames. The local address of the
+ * handle is left unset.
+ *
+ * Returns 0 on success, or a negative value on failure.
+ */
+int open_capture(capture_t **handle, char const *dev, char const *expr, int timeout);
+
+
+
+/* Replace the filter of a capture handle
+ *
+ * Returns 0 on success, or a negative value on failure.
+ */
+int set_filter(capture_t *handle, char const *expr);
+
+
+
+/* Fetch the next captured frame, from either backend
+ *
+ * Wait up to the timeout of the handle if no frame is ready, or not at all
+ * if wait is cleared.
+ *
+ * Returns 1 and loads frame on success, 0 if no frame is ready, or a negative
+ * value on failure.
+ */
+int capture_frame(capture_t *handle, int wait, struct captured *frame);
+
+
+
+/* Set up a packet ring capture
+ *
+ * Capture frames on device dev into a TPACKET_V3 ring, and set the link type
+ * of the capture. Only devices with Ethernet framing (including loopback)
+ * and devices carrying raw IP are supported. Every frame is rejected until
+ * a filter is set with tpacket_filter().
+ *
+ * Returns 0 on success, or a negative value on failure.
+ */
+int tpacket_open(struct capture *cap, char const *dev);
+
+
+
+/* Replace the filter of the packet socket
+ *
+ * Returns 0 on success, or a negative value on failure.
+ */
+int tpacket_filter(struct capture *cap, struct bpf_program const *filter);
+
+
+
+/* Fetch the next frame in the packet ring
+ *
+ * Wait up to timeout milliseconds if no frame is ready (0 doesn't wait).
+ *
+ * Returns 1 and loads frame on success, 0 if no frame is ready, or a negative
+ * value on failure.
+ */
+int tpacket_frame(struct capture *cap, int timeout, struct captured *frame);
+
+
+
+/* Get packet ring statistics, see capture_stats() */
+int tpacket_stats(struct capture *cap, capstats_t *stats);
+
+
+
+/* Unmap the ring and close the packet socket */
+void tpacket_close(struct capture *cap);
+
+#endif
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "receiver.h"
+
+
+
+/* Allocate a connection table */
+int create_table(struct table *table, unsigned capacity, int framed)
+{
+	unsigned i;
+
+	memset(table, 0, sizeof(struct table));
+	table->conns = malloc(sizeof(struct conn) * capacity);
+	table->rcvd = calloc(capacity, sizeof(uint64_t));
+	table->free = malloc(sizeof(unsigned) * capacity);
+	if (framed) {
+		table->framers = malloc(sizeof(struct framer) * capacity);
+		table->hists = malloc(sizeof(hist_t) * capacity);
+	}
+
+	if (table->conns == NULL || table->rcvd == NULL || table->free == NULL
+			|| (framed && (table->framers == NULL || table->hists == NULL))) {
+		destroy_table(table);
+		return -1;
+	}
+
+	/* push slots in reverse, so that the lowest slots are handed out first */
+	for (i = 0; i < capacity; ++i) {
+		table->conns[i].sock = -1;
+		table->conns[i].slot = i;
+		table->free[i] = capacity - 1 - i;
+	}
+	table->nfree = capacity;
+	table->capacity = capacity;
+
+	return 0;
+}
+
+
+
+/* Take a free slot */
+struct conn* insert_conn(struct table *table, int sock)
+{
+	struct conn *conn;
+
+	if (table->nfree == 0)
+		return NULL;
+
+	conn = &table->conns[table->free[--table->nfree]];
+	conn->sock = sock;
+	table->rcvd[conn->slot] = 0;
+	if (table->framers != NULL) {
+		memset(&table->framers[conn->slot], 0, sizeof(struct framer));
+		hist_init(&table->hists[conn->slot]);
+	}
+	return conn;
+}
+
+
+
+/* Put a slot back on the free stack */
+void remove_conn(struct table *table, struct conn *conn)
+{
+	conn->sock = -1;
+	table->free[table->nfree++] = conn->slot;
+}
+
+
+
+/* Close remaining connections and free the table */
+void destroy_table(struct table *table)
+{
+	unsigned i;
+
+	for (i = 0; table->conns != NULL && i < table->capacity; ++i)
+		if (table->conns[i].sock >= 0)
+			close(table->conns[i].sock);
+
+	free(table->conns);
+	free(table->rcvd);
+	free(table->free);
+	free(table->framers);
+	free(table->hists);
+	memset(table, 0, sizeof(struct table));
+}
@@ -0,0 +1,334 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "instance.h"
+#include "evloop.h"
+
+
+/* Maximum number of events handled per epoll_wait() call */
+#define MAX_EVENTS 64
+
+/* Maximum time to wait for events before checking the run flags (ms) */
+#define LOOP_TIMEOUT 100
+
+/* Event data of the wake-up descriptor (streams use twice their index for the
+ * connection and twice their index plus one for the timer)
+ */
+#define WAKE_TAG ((uint64_t) -1)
+
+
+
+/* Event loop state of a stream */
+struct evstream
+{
+	stream_t *stream;
+	stream_ev_t ev;          // state shared with the streamer
+	uint64_t tag;            // event data of the connection (timer is tag + 1)
+	int timer;               // timer descriptor
+	int writing;             // are we waiting for the connection to be writable
+	uint64_t interval;       // current timer interval
+	uint64_t deadline;       // current timer deadline
+	int live;                // is the stream waiting to start or running
+};
+
+
+
+/* Arm the timer of a stream */
+static int arm_timer(struct evstream *s, uint64_t first, uint64_t interval, int flags)
+{
+	struct itimerspec spec;
+
+	spec.it_value.tv_sec = first / 1000000000ULL;
+	spec.it_value.tv_nsec = first % 1000000000ULL;
+	spec.it_interval.tv_sec = interval / 1000000000ULL;
+	spec.it_interval.tv_nsec = interval % 1000000000ULL;
+
+	return timerfd_settime(s->timer, flags, &spec, NULL);
+}
+
+
+
+/* Register the events the streamer has asked for */
+static int update_stream(int efd, struct evstream *s)
+{
+	struct epoll_event ev;
+
+	if (!!s->ev.want_write != s->writing) {
+		ev.events = EPOLLRDHUP | (s->ev.want_write ? EPOLLOUT : 0);
+		ev.data.u64 = s->tag;
+		if (epoll_ctl(efd, EPOLL_CTL_MOD, s->ev.conn, &ev) == -1)
+			return -1;
+		s->writing = !!s->ev.want_write;
+	}
+
+	// a deadline replaces the interval timer until it has expired
+	if (s->ev.deadline != 0 && s->ev.deadline != s->deadline) {
+		if (arm_timer(s, s->ev.deadline, 0, TFD_TIMER_ABSTIME) == -1)
+			return -1;
+		s->deadline = s->ev.deadline;
+		s->interval = 0;
+
+	} else if (s->ev.deadline == 0 && (s->deadline != 0 || s->ev.interval != s->interval)) {
+		if (arm_timer(s, s->ev.interval, s->ev.interval, 0) == -1)
+			return -1;
+		s->deadline = 0;
+		s->interval = s->ev.interval;
+	}
+
+	return 0;
+}
+
+
+
+/* Tell the streamer about acknowledged data */
+static int check_acked(struct evstream *s)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	uint64_t acked;
+
+	if (s->stream->events->on_ack == NULL)
+		return 0;
+
+	if (getsockopt(s->ev.conn, IPPROTO_TCP, TCP_INFO, &info, &len) != 0 || info.tcpi_bytes_acked <= s->ev.acked)
+		return 0;
+
+	acked = info.tcpi_bytes_acked - s->ev.acked;
+	s->ev.acked = info.tcpi_bytes_acked;
+	return s->stream->events->on_ack(&s->ev, acked);
+}
+
+
+
+/* Close a stream, status is the last callback return value */
+static void close_stream(int efd, struct evstream *s, int status)
+{
+	events_t const *cb = s->stream->events;
+
+	if (cb->close != NULL)
+		s->stream->status = cb->close(&s->ev);
+	else
+		s->stream->status = status < 0 ? status : 0;
+
+	// an armed timer that nobody reads would make every epoll_wait() return at once
+	epoll_ctl(efd, EPOLL_CTL_DEL, s->ev.conn, NULL);
+	epoll_ctl(efd, EPOLL_CTL_DEL, s->timer, NULL);
+	s->stream->state = STREAM_DONE;
+}
+
+
+
+/* Start a stream */
+static int open_stream(int efd, struct evstream *s)
+{
+	events_t const *cb = s->stream->events;
+	struct epoll_event ev;
+	int status = 0;
+
+	// event-driven streamers must never block
+	fcntl(s->ev.conn, F_SETFL, fcntl(s->ev.conn, F_GETFL, 0) | O_NONBLOCK);
+
+	ev.events = EPOLLRDHUP;
+	ev.data.u64 = s->tag;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, s->ev.conn, &ev) == -1) {
+		perror("epoll_ctl");
+		s->stream->state = STREAM_DONE;
+		return -1;
+	}
+
+	s->stream->state = STREAM_RUNNING;
+	if (cb->open != NULL && (status = cb->open(&s->ev, s->stream->args)) < 0) {
+		epoll_ctl(efd, EPOLL_CTL_DEL, s->ev.conn, NULL);
+		s->stream->status = status;
+		s->stream->state = STREAM_DONE;
+		return -1;
+	}
+
+	if (status == 0 && update_stream(efd, s) < 0) {
+		perror("update_stream");
+		status = -1;
+	}
+
+	if (status != 0) {
+		close_stream(efd, s, status);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+
+/* Handle an event on a connection or timer */
+static int handle_event(int efd, struct evstream *s, int timer, uint32_t events)
+{
+	events_t const *cb = s->stream->events;
+	uint64_t expirations = 0;
+	int status = 0;
+
+	if (timer) {
+		if (read(s->timer, &expirations, sizeof(expirations)) != sizeof(expirations))
+			return 0;
+
+		// the first expiration is the start of the stream
+		if (s->stream->state == STREAM_WAITING)
+			return open_stream(efd, s) == 0;
+
+		if (s->deadline != 0) {
+			s->deadline = 0;
+			s->ev.deadline = 0;
+		}
+
+		if (cb->on_timer != NULL)
+			status = cb->on_timer(&s->ev, expirations);
+
+	} else if (events & EPOLLERR) {
+		status = -1;
+
+	} else if (events & (EPOLLHUP | EPOLLRDHUP)) {
+		status = 1; // receiver hung up
+
+	} else if ((events & EPOLLOUT) && cb->on_writable != NULL) {
+		status = cb->on_writable(&s->ev);
+	}
+
+	if (status == 0)
+		status = check_acked(s);
+
+	if (status == 0 && update_stream(efd, s) < 0) {
+		perror("update_stream");
+		status = -1;
+	}
+
+	if (status != 0) {
+		close_stream(efd, s, status);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+
+/* Run event-driven streams */
+void event_loop(stream_t **streams, unsigned n, struct timespec const *epoch, int wake)
+{
+	struct evstream *s;
+	struct epoll_event ev, events[MAX_EVENTS];
+	uint64_t start, count;
+	unsigned i, active = 0;
+	int efd, num_events, check;
+
+	if ((s = calloc(n, sizeof(struct evstream))) == NULL) {
+		perror("calloc");
+		return;
+	}
+
+	if ((efd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		perror("epoll_create1");
+		free(s);
+		return;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.u64 = WAKE_TAG;
+	epoll_ctl(efd, EPOLL_CTL_ADD, wake, &ev);
+
+	/* Set up streams, the timer fires the first time at the start offset */
+	for (i = 0; i < n; ++i) {
+		s[i].stream = streams[i];
+		s[i].ev.conn = streams[i]->conn;
+		s[i].tag = 2 * i;
+
+		if ((s[i].timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+			perror("timerfd_create");
+			s[i].timer = -1;
+			continue;
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.u64 = s[i].tag + 1;
+		if (epoll_ctl(efd, EPOLL_CTL_ADD, s[i].timer, &ev) == -1) {
+			perror("epoll_ctl");
+			continue;
+		}
+
+		if (streams[i]->start == 0) {
+			s[i].live = open_stream(efd, &s[i]) == 0;
+			active += s[i].live;
+			continue;
+		}
+
+		start = epoch->tv_sec * 1000000000ULL + epoch->tv_nsec + streams[i]->start * 1000000ULL;
+		if (arm_timer(&s[i], start, 0, TFD_TIMER_ABSTIME) == -1) {
+			perror("timerfd_settime");
+			continue;
+		}
+		s[i].live = 1;
+		++active;
+	}
+
+	/* Run until all streams are done or stopped */
+	while (active > 0) {
+
+		if ((num_events = epoll_wait(efd, events, MAX_EVENTS, LOOP_TIMEOUT)) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+
+		check = num_events == 0;
+		for (i = 0; i < (unsigned) num_events; ++i) {
+			if (events[i].data.u64 == WAKE_TAG) {
+				if (read(wake, &count, sizeof(count)) != sizeof(count) && errno != EAGAIN)
+					perror("read");
+				check = 1;
+				continue;
+			}
+
+			if (!s[events[i].data.u64 / 2].live)
+				continue;
+
+			if (!handle_event(efd, &s[events[i].data.u64 / 2], events[i].data.u64 & 1, events[i].events)) {
+				s[events[i].data.u64 / 2].live = 0;
+				--active;
+			}
+		}
+
+		// stop streams whose run flag has been cleared
+		for (i = 0; check && i < n; ++i) {
+			if (s[i].live && !streams[i]->run) {
+				if (streams[i]->state == STREAM_RUNNING)
+					close_stream(efd, &s[i], 0);
+				else
+					epoll_ctl(efd, EPOLL_CTL_DEL, s[i].timer, NULL);
+				s[i].live = 0;
+				--active;
+			}
+		}
+	}
+
+	/* Close streams that are still running */
+	for (i = 0; i < n; ++i) {
+		if (streams[i]->state == STREAM_RUNNING)
+			close_stream(efd, &s[i], 0);
+		if (s[i].timer >= 0)
+			close(s[i].timer);
+	}
+
+	close(efd);
+	free(s);
+}
@@ -0,0 +1,18 @@
+#ifndef __EVLOOP__
+#define __EVLOOP__
+
+#include <time.h>
+#include "instance.h"
+
+
+/* Run event-driven streams
+ *
+ * Drive the n event-driven streams from a single thread until all of them
+ * are complete or their run flags are cleared. Every stream is opened once
+ * its start offset from epoch has passed, and closed when it is stopped. The
+ * wake event descriptor is signalled when run flags change, so that the loop
+ * doesn't have to poll for them.
+ */
+void event_loop(stream_t **streams, unsigned n, struct timespec const *epoch, int wake);
+
+#endif
@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "flowtable.h"
+
+
+
+/* Make the key of a segment */
+int make_key(struct flow_key *key, uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport)
+{
+	int side = saddr > daddr || (saddr == daddr && sport > dport);
+
+	key->addr[side] = saddr;
+	key->port[side] = sport;
+	key->addr[!side] = daddr;
+	key->port[!side] = dport;
+	return side;
+}
+
+
+
+/* Hash a flow key */
+uint32_t hash_key(struct flow_key const *key)
+{
+	uint64_t h;
+
+	// multiply-xorshift mix of the packed tuple
+	h = ((uint64_t) key->addr[0] << 32 | key->addr[1]) ^ (((uint64_t) key->port[0] << 16 | key->port[1]) * 0x9e3779b97f4a7c15ULL);
+	h ^= h >> 31;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 29;
+	return (uint32_t) h;
+}
+
+
+
+/* Compare two flow keys */
+static int same_key(struct flow_key const *a, struct flow_key const *b)
+{
+	return a->addr[0] == b->addr[0] && a->addr[1] == b->addr[1]
+		&& a->port[0] == b->port[0] && a->port[1] == b->port[1];
+}
+
+
+
+/* Allocate a flow table */
+int create_flowtable(struct flowtable *table, size_t capacity, size_t value_size)
+{
+	size_t n = 16;
+
+	while (n < capacity)
+		n <<= 1;
+
+	memset(table, 0, sizeof(struct flowtable));
+	table->keys = malloc(sizeof(struct flow_key) * n);
+	table->used = calloc(n, sizeof(uint8_t));
+	table->values = malloc(value_size * n);
+	if (table->keys == NULL || table->used == NULL || table->values == NULL) {
+		destroy_flowtable(table);
+		return -1;
+	}
+
+	table->value_size = value_size;
+	table->capacity = n;
+	return 0;
+}
+
+
+
+/* Double the number of slots and put every flow back in */
+static int grow(struct flowtable *table)
+{
+	struct flowtable bigger;
+	size_t i, j;
+
+	if (create_flowtable(&bigger, table->capacity * 2, table->value_size) < 0)
+		return -1;
+
+	for (i = 0; i < table->capacity; ++i) {
+		if (!table->used[i])
+			continue;
+
+		for (j = hash_key(&table->keys[i]) & (bigger.capacity - 1); bigger.used[j]; j = (j + 1) & (bigger.capacity - 1));
+		bigger.keys[j] = table->keys[i];
+		bigger.used[j] = 1;
+		memcpy(bigger.values + j * bigger.value_size, table->values + i * table->value_size, table->value_size);
+	}
+
+	bigger.count = table->count;
+	destroy_flowtable(table);
+	*table = bigger;
+	return 0;
+}
+
+
+
+/* Find the value of a flow */
+void* lookup_flow(struct flowtable *table, struct flow_key const *key, int insert)
+{
+	size_t i, mask = table->capacity - 1;
+
+	for (i = hash_key(key) & mask; table->used[i]; i = (i + 1) & mask)
+		if (same_key(&table->keys[i], key))
+			return table->values + i * table->value_size;
+
+	if (!insert)
+		return NULL;
+
+	// keep the table sparse enough for short probe sequences
+	if ((table->count + 1) * 4 > table->capacity * 3) {
+		if (grow(table) < 0)
+			return NULL;
+		mask = table->capacity - 1;
+		for (i = hash_key(key) & mask; table->used[i]; i = (i + 1) & mask);
+	}
+
+	table->keys[i] = *key;
+	table->used[i] = 1;
+	++table->count;
+	memset(table->values + i * table->value_size, 0, table->value_size);
+	return table->values + i * table->value_size;
+}
+
+
+
+/* Remove a flow */
+int remove_flow(struct flowtable *table, struct flow_key const *key)
+{
+	size_t i, j, home, mask = table->capacity - 1;
+
+	for (i = hash_key(key) & mask; table->used[i]; i = (i + 1) & mask)
+		if (same_key(&table->keys[i], key))
+			break;
+
+	if (!table->used[i])
+		return -1;
+
+	// shift the rest of the probe sequence back instead of leaving a tombstone,
+	// an entry may fill the hole if the hole lies between its home slot and it
+	for (j = (i + 1) & mask; table->used[j]; j = (j + 1) & mask) {
+		home = hash_key(&table->keys[j]) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			table->keys[i] = table->keys[j];
+			memcpy(table->values + i * table->value_size, table->values + j * table->value_size, table->value_size);
+			i = j;
+		}
+	}
+
+	table->used[i] = 0;
+	--table->count;
+	return 0;
+}
+
+
+
+/* Get the value in a slot */
+void* flow_slot(struct flowtable const *table, size_t i)
+{
+	return table->used[i] ? table->values + i * table->value_size : NULL;
+}
+
+
+
+/* Free the flow table */
+void destroy_flowtable(struct flowtable *table)
+{
+	free(table->keys);
+	free(table->used);
+	free(table->values);
+	memset(table, 0, sizeof(struct flowtable));
+}
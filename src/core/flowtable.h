@@ -0,0 +1,90 @@
+#ifndef __FLOWTABLE__
+#define __FLOWTABLE__
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* Flow identifier
+ *
+ * The 4-tuple of a TCP connection in network byte order, with the endpoints
+ * in a fixed order so that both directions of a connection share a key.
+ */
+struct flow_key
+{
+	uint32_t addr[2];        // addresses of endpoint 0 and 1
+	uint16_t port[2];        // ports of endpoint 0 and 1
+};
+
+
+
+/* Open-addressing flow table
+ *
+ * Maps flow keys to fixed-size values stored in the table itself, probing
+ * linearly from the slot given by the key hash. The table doubles when it is
+ * three quarters full, which moves the values.
+ */
+struct flowtable
+{
+	struct flow_key *keys;   // key of every slot
+	uint8_t *used;           // is the slot in use
+	char *values;            // value of every slot
+	size_t value_size;       // size of a value
+	size_t capacity;         // number of slots (a power of two)
+	size_t count;            // number of slots in use
+};
+
+
+
+/* Make the key of a segment sent from saddr:sport to daddr:dport
+ *
+ * Returns the endpoint number of the sender (0 or 1).
+ */
+int make_key(struct flow_key *key, uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport);
+
+
+
+/* Hash a flow key */
+uint32_t hash_key(struct flow_key const *key);
+
+
+
+/* Allocate a flow table with room for at least capacity flows
+ *
+ * Returns 0 on success, or a negative value on failure.
+ */
+int create_flowtable(struct flowtable *table, size_t capacity, size_t value_size);
+
+
+
+/* Find the value of a flow
+ *
+ * If the flow isn't in the table and insert is set, the flow is added with
+ * a zeroed value. The value pointer is valid until the next insert.
+ *
+ * Returns the value, or NULL if the flow isn't found (or can't be added).
+ */
+void* lookup_flow(struct flowtable *table, struct flow_key const *key, int insert);
+
+
+
+/* Remove a flow from the table
+ *
+ * Entries after it in the probe sequence may move, which invalidates value
+ * pointers and slot numbers.
+ *
+ * Returns 0 on success, or -1 if the flow isn't in the table.
+ */
+int remove_flow(struct flowtable *table, struct flow_key const *key);
+
+
+
+/* Get the value in slot i, or NULL if the slot isn't in use */
+void* flow_slot(struct flowtable const *table, size_t i);
+
+
+
+/* Free the flow table */
+void destroy_flowtable(struct flowtable *table);
+
+#endif
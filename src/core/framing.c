@@ -0,0 +1,71 @@
+#include <arpa/inet.h>
+#include <endian.h>
+#include <string.h>
+#include <time.h>
+#include "receiver.h"
+
+
+
+/* Current time of the frame clock in nanoseconds */
+uint64_t frame_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(FRAME_CLOCK, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+
+/* Parse frames from received data */
+void parse_frames(struct framer *f, hist_t *hist, char const *buf, size_t len, uint64_t now)
+{
+	frame_t hdr;
+	size_t n;
+
+	while (len > 0 && !f->broken) {
+
+		/* skip payload of the current frame */
+		if (f->left > 0) {
+			n = f->left < len ? f->left : len;
+			f->left -= n;
+			buf += n;
+			len -= n;
+
+			if (f->left > 0)
+				break;
+
+			// frame is complete
+			if (f->ts > now)
+				++f->early;
+			hist_add(hist, f->ts > now ? 0 : now - f->ts);
+			continue;
+		}
+
+		/* assemble frame header */
+		n = sizeof(frame_t) - f->have < len ? sizeof(frame_t) - f->have : len;
+		memcpy(f->hdr + f->have, buf, n);
+		f->have += n;
+		buf += n;
+		len -= n;
+
+		if (f->have < sizeof(frame_t))
+			break;
+
+		memcpy(&hdr, f->hdr, sizeof(frame_t));
+		f->have = 0;
+		f->left = ntohl(hdr.len);
+		f->ts = be64toh(hdr.ts);
+
+		if (f->left > FRAME_MAX) {
+			f->broken = 1; // not a frame header, give up on this connection
+			break;
+		}
+
+		// frame without payload is complete right away
+		if (f->left == 0) {
+			if (f->ts > now)
+				++f->early;
+			hist_add(hist, f->ts > now ? 0 : now - f->ts);
+		}
+	}
+}
@@ -0,0 +1,95 @@
+#include <stdint.h>
+#include <string.h>
+#include "utils.h"
+
+
+
+/* Bucket index of a value */
+static unsigned bucket_index(uint64_t value)
+{
+	unsigned exp;
+
+	if (value < HIST_SUB)
+		return value;
+
+	exp = 63 - __builtin_clzll(value); // position of the most significant bit
+	return (exp - 3) * HIST_SUB + ((value >> (exp - 4)) & (HIST_SUB - 1));
+}
+
+
+
+/* Largest value that falls into a bucket */
+static uint64_t bucket_limit(unsigned idx)
+{
+	unsigned exp, sub;
+
+	if (idx < HIST_SUB)
+		return idx;
+
+	exp = idx / HIST_SUB + 3;
+	sub = idx % HIST_SUB;
+	return ((((uint64_t) HIST_SUB + sub + 1) << (exp - 4))) - 1;
+}
+
+
+
+/* Reset a histogram */
+void hist_init(hist_t *hist)
+{
+	memset(hist, 0, sizeof(hist_t));
+	hist->min = UINT64_MAX;
+}
+
+
+
+/* Record a value */
+void hist_add(hist_t *hist, uint64_t value)
+{
+	++hist->buckets[bucket_index(value)];
+	++hist->count;
+	hist->min = value < hist->min ? value : hist->min;
+	hist->max = value > hist->max ? value : hist->max;
+}
+
+
+
+/* Merge two histograms */
+void hist_merge(hist_t *dst, hist_t const *src)
+{
+	unsigned i;
+
+	if (src->count == 0)
+		return;
+
+	for (i = 0; i < HIST_BUCKETS; ++i)
+		dst->buckets[i] += src->buckets[i];
+
+	dst->count += src->count;
+	dst->min = src->min < dst->min ? src->min : dst->min;
+	dst->max = src->max > dst->max ? src->max : dst->max;
+}
+
+
+
+/* Find the value at a percentile */
+uint64_t hist_percentile(hist_t const *hist, double percentile)
+{
+	uint64_t rank, seen = 0, limit;
+	unsigned i;
+
+	if (hist->count == 0)
+		return 0;
+
+	rank = (uint64_t) (percentile / 100.0 * hist->count + 0.5);
+	rank = rank < 1 ? 1 : rank;
+
+	for (i = 0; i < HIST_BUCKETS; ++i) {
+		seen += hist->buckets[i];
+		if (seen >= rank) {
+			limit = bucket_limit(i);
+			return limit < hist->max ? limit : hist->max;
+		}
+	}
+
+	return hist->max;
+}
@@ -1,6 +1,8 @@
 #ifndef __INSTANCE__
 #define __INSTANCE__
 
+#include "events.h"
+
 /* Macro for turning a define into string 
  * Use this to convert the streamer defines into strings.
  */
@@ -45,14 +47,15 @@ typedef void (*callback_t)(streamer_t entry_point);
 /* Load streamer functions from shared object file.
  *
  * Load a shared object file with file name given by the name argument,
- * and load the symbols for the entry point and initialization function. 
- * The latter can be set to NULL, but entry_point will always be set 
- * (otherwise it is an invalid streamer).
+ * and load the symbols for the entry point, the event callbacks (see
+ * events_t) and initialization function. Any of them can be set to NULL,
+ * but either entry_point or events will always be set (otherwise it is an
+ * invalid streamer).
  * 
  * Returns 0 on success, -1 if supplied file is invalid or -2 if symbol isn't
  * found.
  */
-int load_streamer(void **handle, char const *name, streamer_t *entry_point, callback_t *init);
+int load_streamer(void **handle, char const *name, streamer_t *entry_point, events_t const **events, callback_t *init);
 
 
 
@@ -64,32 +67,89 @@ void unload_streamer(void *handle);
 
 
 
+/* Stream descriptor
+ *
+ * Describes a stream run by streamer(), filled in by the caller. If events
+ * is set, the stream is event-driven and entry is not used. Every stream has
+ * its own run flag, which is passed on to the streamer as its run condition.
+ * The status is set to the streamer return value when the streamer has
+ * completed, or to -1 if it never started or had to be cancelled.
+ */
+typedef struct {
+	char const *name;        // streamer name used when reporting (can be NULL)
+	streamer_t entry;        // streamer entry point
+	events_t const *events;  // event-driven streamer callbacks
+	char const **args;       // streamer arguments (see register_argument())
+	char const *sockopt;     // socket option profile (see sockopt_t), used by the caller
+	int conn;                // connection socket descriptor
+	unsigned start;          // start offset from the beginning of the run (ms)
+	unsigned stop;           // stop offset from the beginning of the run (ms), zero to run until the end
+	int run;                 // run flag (set by streamer())
+	int status;              // streamer return value
+	enum { STREAM_WAITING = 0, STREAM_RUNNING, STREAM_DONE } state; // set by streamer()
+} stream_t;
+
+
+
 /* Streamer control.
  *
  * After loading a streamer entry point symbol, call it by passing it on to
- * this control function. This function spawns a new thread which calls the 
- * streamer entry point. The connection, condition and args arguments
- * are passed on directly to the streamer.
+ * this control function. This function spawns a thread for each of the n
+ * streams, spread across the available cores, which calls the streamer entry
+ * point of the stream once its start offset has passed. Event-driven streams
+ * are instead shared between one event loop thread per core. The connection
+ * and args of the stream are passed on directly to the streamer, and all
+ * streams are stopped when condition is set to false.
  *
- * A streamer will run either until completion (that is, the streamer entry 
- * point returns) or until it is cancelled. If duration is non-zero, the
- * streamer will run for maximum that amount of seconds. If duration is
- * zero, then the streamer will run until condition is set to false otherwise.
- * If the streamer doesn't return after condition changes to zero, this
+ * Streamers will run either until completion (that is, all streamer entry 
+ * points return) or until they are cancelled. A stream with a stop offset
+ * has its run flag cleared at that time. If duration is non-zero, the
+ * streamers will run for maximum that amount of seconds. If duration is
+ * zero, then the streamers will run until condition is set to false otherwise.
+ * If a streamer doesn't return after condition changes to zero, this
  * control function will cancel the streamer thread, forcing the streamer
  * to quit.
  *
- * Returns the return value from the streamer.
+ * The status code and TCP statistics of every stream are reported, along
+ * with the aggregate over all streams.
+ *
+ * Returns the first non-zero return value from the streamers, or zero.
  */
-int streamer(streamer_t entry, unsigned dur, int conn, int *cond, char const **args);
+int streamer(stream_t *streams, unsigned n, unsigned dur, int *cond);
+
+
+
+/* Receiver options */
+typedef struct {
+	unsigned workers;   // number of receiver threads (0 or 1 means a single receiver)
+	enum {
+		RCV_EPOLL = 0,  // edge-triggered epoll and read()
+		RCV_URING       // io_uring multishot accept/recv with provided buffers
+	} engine;           // receive engine used by the workers
+	int discard;        // drain sockets without copying the payload to user space
+	size_t rdsz;        // number of bytes to read per call (0 means DEF_READ)
+	unsigned capacity;  // maximum number of connections per worker (0 means DEF_CONNS)
+	int backlog;        // listen backlog (0 means DEF_BACKLOG)
+	int framed;         // parse frame headers (see frame_t) and measure one-way delay
+} rcv_opts_t;
 
 
 
 /* Receiver control
  *
- * Start a receiver which accepts new connections and receive bytes from active
- * connections. It will stop when condition is set to zero.
+ * Start a receiver which accepts new connections on port and receive bytes
+ * from active connections. It will stop when condition is set to zero.
+ *
+ * If more than one worker is requested, each worker thread binds its own
+ * listening socket to port using SO_REUSEPORT and keeps its own connection
+ * table, letting the kernel spread incoming connections across the workers.
+ * Byte counters from every worker are merged and reported at shutdown,
+ * along with the number of system calls made in the receive path so that
+ * the receive engines can be compared.
+ *
+ * Returns 0 on success, or a negative value if the receiver couldn't be
+ * started.
  */
-void receiver(int conn, int *cond);
+int receiver(char const *port, rcv_opts_t const *opts, int *cond);
 
 #endif
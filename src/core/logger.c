@@ -0,0 +1,213 @@
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "logger.h"
+#include "ring.h"
+
+
+/* Number of records in each log ring */
+#define LOG_RECORDS 4096
+
+/* How long the logger sleeps when all rings are empty (ns) */
+#define LOG_IDLE (1000 * 1000)
+
+
+
+/* Fixed-size log record */
+struct log_rec {
+	int64_t       bytes;                // number of bytes (or frames)
+	enum log_type type;                 // event type
+	char          name[INET_ADDRSTRLEN]; // remote host name
+	uint64_t      delay[4];             // p50, p99, p99.9 and max delay (ns)
+};
+
+
+
+/* Log ring belonging to a source */
+struct source {
+	struct ring *ring;      // log records
+	uint64_t     dropped;   // records dropped because the ring was full (written by source)
+	uint64_t     reported;  // dropped records reported so far (written by logger)
+};
+
+
+static struct source *sources = NULL;
+
+static unsigned num_sources = 0;
+
+static pthread_t thread;
+
+static int running = 0;
+
+
+
+/* Write out a log record */
+static void write_record(struct log_rec const *rec)
+{
+	switch (rec->type) {
+		case LOG_ACCEPT:
+			fprintf(stdout, "Accepted connection from %s\n", rec->name);
+			break;
+
+		case LOG_RECV:
+			fprintf(stdout, "Received %" PRId64 " bytes from %s\n", rec->bytes, rec->name);
+			break;
+
+		case LOG_CLOSE:
+			fprintf(stdout, "Closing connection from %s\n", rec->name);
+			break;
+
+		case LOG_REJECT:
+			fprintf(stdout, "Rejected connection from %s, connection table is full\n", rec->name);
+			break;
+
+		case LOG_DELAY:
+			fprintf(stdout, "Frame delay from %s: %" PRId64 " frames, p50 %.3lf ms, p99 %.3lf ms, p99.9 %.3lf ms, max %.3lf ms\n",
+					rec->name, rec->bytes, rec->delay[0] / 1e6, rec->delay[1] / 1e6, rec->delay[2] / 1e6, rec->delay[3] / 1e6);
+			break;
+	}
+}
+
+
+
+/* Drain log rings, returns the number of records written */
+static unsigned drain_rings(void)
+{
+	struct log_rec rec;
+	uint64_t dropped;
+	unsigned i, n = 0;
+
+	for (i = 0; i < num_sources; ++i) {
+		while (ring_pop(sources[i].ring, &rec)) {
+			write_record(&rec);
+			++n;
+		}
+
+		dropped = __atomic_load_n(&sources[i].dropped, __ATOMIC_RELAXED);
+		if (dropped != sources[i].reported) {
+			fprintf(stdout, "Dropped %" PRIu64 " log records\n", dropped - sources[i].reported);
+			sources[i].reported = dropped;
+		}
+	}
+
+	return n;
+}
+
+
+
+/* Background thread draining log rings */
+static void* run_logger(void *arg)
+{
+	struct timespec idle = { 0, LOG_IDLE };
+	(void) arg;
+
+	while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		if (drain_rings() == 0) {
+			fflush(stdout);
+			nanosleep(&idle, NULL);
+		}
+	}
+
+	drain_rings();
+	fflush(stdout);
+	return NULL;
+}
+
+
+
+/* Start the asynchronous logger */
+int start_logger(unsigned n)
+{
+	unsigned i;
+
+	if ((sources = calloc(n, sizeof(struct source))) == NULL)
+		return -1;
+
+	for (i = 0; i < n; ++i) {
+		if ((sources[i].ring = ring_create(LOG_RECORDS, sizeof(struct log_rec))) == NULL) {
+			while (i-- > 0)
+				ring_destroy(sources[i].ring);
+			free(sources);
+			sources = NULL;
+			return -1;
+		}
+	}
+	num_sources = n;
+
+	running = 1;
+	if (pthread_create(&thread, NULL, &run_logger, NULL) != 0) {
+		running = 0;
+		stop_logger();
+		return -2;
+	}
+
+	return 0;
+}
+
+
+
+/* Push a record onto the ring of a source */
+static void push_record(unsigned source, struct log_rec const *rec)
+{
+	if (ring_push(sources[source].ring, rec) < 0)
+		__atomic_store_n(&sources[source].dropped, sources[source].dropped + 1, __ATOMIC_RELAXED);
+}
+
+
+
+/* Log an event */
+void log_event(unsigned source, enum log_type type, char const *name, int64_t bytes)
+{
+	struct log_rec rec;
+
+	rec.bytes = bytes;
+	rec.type = type;
+	strncpy(rec.name, name, sizeof(rec.name));
+	rec.name[sizeof(rec.name) - 1] = '\0';
+
+	push_record(source, &rec);
+}
+
+
+
+/* Log frame delays */
+void log_delay(unsigned source, char const *name, hist_t const *hist)
+{
+	struct log_rec rec;
+
+	rec.bytes = hist->count;
+	rec.type = LOG_DELAY;
+	strncpy(rec.name, name, sizeof(rec.name));
+	rec.name[sizeof(rec.name) - 1] = '\0';
+	rec.delay[0] = hist_percentile(hist, 50.0);
+	rec.delay[1] = hist_percentile(hist, 99.0);
+	rec.delay[2] = hist_percentile(hist, 99.9);
+	rec.delay[3] = hist->max;
+
+	push_record(source, &rec);
+}
+
+
+
+/* Stop the asynchronous logger */
+void stop_logger(void)
+{
+	unsigned i;
+
+	if (running) {
+		__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+		pthread_join(thread, NULL);
+	}
+
+	for (i = 0; i < num_sources; ++i)
+		ring_destroy(sources[i].ring);
+	free(sources);
+	sources = NULL;
+	num_sources = 0;
+}
@@ -0,0 +1,63 @@
+#ifndef __LOGGER__
+#define __LOGGER__
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "utils.h"
+
+
+/* Log event types */
+enum log_type {
+	LOG_ACCEPT,     // connection accepted
+	LOG_RECV,       // bytes received from connection
+	LOG_CLOSE,      // connection closed
+	LOG_REJECT,     // connection rejected (connection table is full)
+	LOG_DELAY       // one-way frame delays of a connection
+};
+
+
+
+/* Start the asynchronous logger
+ *
+ * Create one lock-free log ring for each of the sources (e.g. receiver
+ * workers) and a background thread which drains the rings and writes the
+ * formatted events to stdout. Formatting and writing output is thereby kept
+ * out of the hot path of the sources.
+ *
+ * Returns 0 on success, or a negative value on failure.
+ */
+int start_logger(unsigned sources);
+
+
+
+/* Log an event
+ *
+ * Push a fixed-size record describing the event onto the ring belonging to
+ * source. Only one thread may log events for a given source. The name is
+ * the (already resolved) name of the remote host, and bytes is the number
+ * of bytes the event concerns.
+ *
+ * If the ring is full, because stdout can't keep up, the event is dropped
+ * and counted instead of blocking the caller.
+ */
+void log_event(unsigned source, enum log_type type, char const *name, int64_t bytes);
+
+
+
+/* Log the one-way frame delays of a connection
+ *
+ * The percentiles are taken from hist by the caller, only the summary is
+ * pushed onto the ring.
+ */
+void log_delay(unsigned source, char const *name, hist_t const *hist);
+
+
+
+/* Stop the asynchronous logger
+ *
+ * Wait for the background thread to write out remaining events, report
+ * the number of dropped events and free the log rings.
+ */
+void stop_logger(void);
+
+#endif
@@ -12,6 +12,8 @@
 #include "instance.h"
 #include "utils.h"
 #include "bootstrap.h"
+#include "scenario.h"
+#include "analyze.h"
 
 
 
@@ -28,6 +30,28 @@
 
 
 
+/* Core long options (values outside the range of short options) */
+enum { OPT_DISCARD = 256, OPT_READ_SIZE, OPT_MAX_CONNS, OPT_BACKLOG, OPT_FRAMED, OPT_STAGGER, OPT_SCENARIO, OPT_SOCKOPT, OPT_ANALYZE };
+
+static struct option const core_params[] = {
+	{ "discard",   no_argument,       NULL, OPT_DISCARD   },
+	{ "read-size", required_argument, NULL, OPT_READ_SIZE },
+	{ "max-conns", required_argument, NULL, OPT_MAX_CONNS },
+	{ "backlog",   required_argument, NULL, OPT_BACKLOG   },
+	{ "framed",    no_argument,       NULL, OPT_FRAMED    },
+	{ "stagger",   required_argument, NULL, OPT_STAGGER   },
+	{ "scenario",  required_argument, NULL, OPT_SCENARIO  },
+	{ "sockopt",   required_argument, NULL, OPT_SOCKOPT   },
+	{ "analyze",   no_argument,       NULL, OPT_ANALYZE   },
+	{ NULL,        0,                 NULL, 0             }
+};
+
+/* Number of core long options */
+#define CORE_PARAMS ((int) (sizeof(core_params) / sizeof(struct option)) - 1)
+
+/* Core long options followed by streamer parameters */
+static struct option *all_params = NULL;
+
 /* Streamer parameter list */
 static struct option *streamer_params = NULL;
 
@@ -37,9 +61,28 @@ static char const **streamer_args = NULL;
 /* Pointer to streamer entry point */
 static streamer_t streamer_entry = NULL;
 
+/* Pointer to event-driven streamer callbacks */
+static events_t const *streamer_events = NULL;
+
 /* Pointer to streamer bootstrapper */
 static callback_t streamer_init = NULL;
 
+/* Streamer loaded for a scenario */
+struct plugin
+{
+	char const *name;
+	void *handle;
+	streamer_t entry;
+	events_t const *events;
+	struct option *params;
+};
+
+/* Streamers loaded for a scenario, every streamer is loaded once */
+static struct plugin *plugins = NULL;
+
+/* Number of streamers loaded for a scenario */
+static unsigned num_plugins = 0;
+
 /* Are we running */
 static int streamer_state = 0;
 
@@ -62,7 +105,11 @@ int register_argument(char const *name, int *ref, int val)
 	int i;
 
 	/* Verify that the context is correct */
-	assert(streamer_entry != NULL);
+	assert(streamer_entry != NULL || streamer_events != NULL);
+
+	for (i = 0; i < CORE_PARAMS; ++i)
+		if (strcmp(core_params[i].name, name) == 0)
+			return -1;
 
 	for (i = 0; streamer_params != NULL && streamer_params[i].name != NULL; ++i)
 		if (strcmp(streamer_params[i].name, name) == 0)
@@ -89,7 +136,7 @@ static int bootstrap_streamer(void **handle, char const *streamer)
 	int i, n;
 
 	/* Load streamer */
-	if (load_streamer(handle, streamer, &streamer_entry, &streamer_init) < 0)
+	if (load_streamer(handle, streamer, &streamer_entry, &streamer_events, &streamer_init) < 0)
 		return -1;
 
 	/* Bootstrap streamer */
@@ -116,6 +163,111 @@ static int bootstrap_streamer(void **handle, char const *streamer)
 
 
 
+/* Find a streamer loaded for a scenario */
+static struct plugin* find_plugin(char const *name)
+{
+	unsigned i;
+
+	for (i = 0; i < num_plugins; ++i)
+		if (strcmp(plugins[i].name, name) == 0)
+			return &plugins[i];
+
+	return NULL;
+}
+
+
+
+/* Load the streamers of a scenario and parse the arguments of every group */
+static int load_scenario(struct group *groups, int n)
+{
+	struct plugin *plugin;
+	void *handle = NULL;
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		if ((plugin = find_plugin(groups[i].streamer)) == NULL) {
+			if ((plugin = realloc(plugins, sizeof(struct plugin) * (num_plugins + 1))) == NULL)
+				return -1;
+			plugins = plugin;
+
+			// bootstrap the streamer as if it was selected with -s
+			if (bootstrap_streamer(&handle, groups[i].streamer) < 0) {
+				fprintf(stderr, "No such streamer: %s\n", groups[i].streamer);
+				unload_streamer(handle);
+				return -1;
+			}
+
+			plugin = &plugins[num_plugins++];
+			plugin->name = groups[i].streamer;
+			plugin->handle = handle;
+			plugin->entry = streamer_entry;
+			plugin->events = streamer_events;
+			plugin->params = streamer_params;
+
+			free(streamer_args);
+			streamer_args = NULL;
+			streamer_params = NULL;
+			streamer_entry = NULL;
+			streamer_events = NULL;
+		}
+
+		if (parse_args(&groups[i], plugin->params) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+
+/* Describe the streams of every flow group in a scenario */
+static void setup_groups(stream_t *streams, struct group const *groups, int n, unsigned stagger, char const *sockopt)
+{
+	struct plugin *plugin;
+	unsigned k;
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		plugin = find_plugin(groups[i].streamer);
+		for (k = 0; k < groups[i].count; ++k, ++streams) {
+			streams->name = groups[i].streamer;
+			streams->entry = plugin->entry;
+			streams->events = plugin->events;
+			streams->args = groups[i].args;
+			streams->sockopt = groups[i].sockopt != NULL ? groups[i].sockopt : sockopt;
+			streams->start = groups[i].start + k * stagger;
+			streams->stop = groups[i].dur != 0 ? streams->start + groups[i].dur : 0;
+		}
+	}
+}
+
+
+
+/* Merge core long options and streamer parameters into one option list
+ *
+ * Streamer parameters are placed after the core options, so the streamer
+ * argument index is the option index minus CORE_PARAMS.
+ */
+static int merge_params(void)
+{
+	int n;
+
+	for (n = 0; streamer_params != NULL && streamer_params[n].name != NULL; ++n);
+
+	free(all_params);
+	if ((all_params = malloc(sizeof(struct option) * (CORE_PARAMS + n + 1))) == NULL)
+		return -1;
+
+	memcpy(all_params, core_params, sizeof(struct option) * CORE_PARAMS);
+	if (n > 0)
+		memcpy(all_params + CORE_PARAMS, streamer_params, sizeof(struct option) * n);
+	memcpy(all_params + CORE_PARAMS + n, &core_params[CORE_PARAMS], sizeof(struct option));
+
+	return 0;
+}
+
+
+
 /* Print program usage */
 static void give_usage(char *prog_name, char *streamer);
 
@@ -124,18 +276,25 @@ static void give_usage(char *prog_name, char *streamer);
 
 int main(int argc, char **argv)
 {
-	int i, sock_fd = -1;
+	int i, num_groups = 0;
 	void *handle = NULL;
-	char *streamer_name = NULL;
-	unsigned duration = DEF_DUR;
+	char *streamer_name = NULL, *scenario = NULL, *sockopt = NULL;
+	struct group *groups = NULL;
+	unsigned duration = DEF_DUR, num_streams = 1, stagger = 0, connected = 0;
+	stream_t *streams = NULL;
 	char *port = DEF_2_STR(DEF_PORT), *host = NULL, *sptr = NULL;
 	char hostname[INET_ADDRSTRLEN];
 	struct sockaddr_in addr;
+	rcv_opts_t rcv_opts = { 0 };
+	sockopt_t sock_opts = { 0 };
 
 
 	/* Parse command line options and arguments */
-	int opt, help = 0, optidx = -1; 
-	while ((opt = getopt_long(argc, argv, ":ht:p:s:", streamer_params, &optidx)) != -1) {
+	int opt, help = 0, analysis = 0, optidx = -1; 
+	if (merge_params() < 0)
+		goto cleanup_and_die;
+
+	while ((opt = getopt_long(argc, argv, ":hj:un:t:p:s:", all_params, &optidx)) != -1) {
 		switch (opt) {
 			case ':': // missing value
 				if (argv[optind-1][1] == '-') {
@@ -165,6 +324,84 @@ int main(int argc, char **argv)
 				port = optarg;
 				break;
 
+			case 'j': // receiver workers
+				sptr = NULL;
+				rcv_opts.workers = strtoul(optarg, &sptr, 10);
+				if (sptr == NULL || *sptr != '\0' || rcv_opts.workers == 0) {
+					fprintf(stderr, "Option -j requires a valid number of workers\n");
+					goto cleanup_and_die;
+				}
+				break;
+
+			case OPT_DISCARD: // drain without copying
+				rcv_opts.discard = 1;
+				break;
+
+			case OPT_READ_SIZE: // bytes per read call
+				sptr = NULL;
+				rcv_opts.rdsz = strtoul(optarg, &sptr, 0);
+				if (sptr == NULL || *sptr != '\0' || rcv_opts.rdsz == 0) {
+					fprintf(stderr, "Argument --read-size requires a valid number of bytes\n");
+					goto cleanup_and_die;
+				}
+				break;
+
+			case OPT_MAX_CONNS: // connection table capacity
+				sptr = NULL;
+				rcv_opts.capacity = strtoul(optarg, &sptr, 10);
+				if (sptr == NULL || *sptr != '\0' || rcv_opts.capacity == 0) {
+					fprintf(stderr, "Argument --max-conns requires a valid number of connections\n");
+					goto cleanup_and_die;
+				}
+				break;
+
+			case OPT_BACKLOG: // listen backlog
+				sptr = NULL;
+				rcv_opts.backlog = strtol(optarg, &sptr, 10);
+				if (sptr == NULL || *sptr != '\0' || rcv_opts.backlog <= 0) {
+					fprintf(stderr, "Argument --backlog requires a valid queue length\n");
+					goto cleanup_and_die;
+				}
+				break;
+
+			case OPT_FRAMED: // measure one-way frame delay
+				rcv_opts.framed = 1;
+				break;
+
+			case 'u': // io_uring receive engine
+				rcv_opts.engine = RCV_URING;
+				break;
+
+			case 'n': // number of streams
+				sptr = NULL;
+				num_streams = strtoul(optarg, &sptr, 10);
+				if (sptr == NULL || *sptr != '\0' || num_streams == 0) {
+					fprintf(stderr, "Option -n requires a valid number of streams\n");
+					goto cleanup_and_die;
+				}
+				break;
+
+			case OPT_STAGGER: // delay between stream starts
+				sptr = NULL;
+				stagger = strtoul(optarg, &sptr, 10);
+				if (sptr == NULL || *sptr != '\0') {
+					fprintf(stderr, "Argument --stagger requires a valid number of milliseconds\n");
+					goto cleanup_and_die;
+				}
+				break;
+
+			case OPT_SCENARIO: // run flow groups from file
+				scenario = optarg;
+				break;
+
+			case OPT_SOCKOPT: // socket option profile
+				sockopt = optarg;
+				break;
+
+			case OPT_ANALYZE: // analyse capture files
+				analysis = 1;
+				break;
+
 			case 't': // duration
 				sptr = NULL;
 				duration = strtoul(optarg, &sptr, 10);
@@ -175,7 +412,7 @@ int main(int argc, char **argv)
 				break;
 
 			case 's': // select streamer
-				if (streamer_entry != NULL) {
+				if (streamer_name != NULL) {
 					fprintf(stderr, "Streamer is already selected\n");
 					goto cleanup_and_die;
 				}
@@ -184,10 +421,13 @@ int main(int argc, char **argv)
 					fprintf(stderr, "No such streamer: %s\n", optarg);
 					goto cleanup_and_die;
 				}
+				if (merge_params() < 0)
+					goto cleanup_and_die;
 				streamer_name = optarg;
 				break;
 
 			default:
+				optidx -= CORE_PARAMS;
 				if (streamer_args[optidx] != NULL) {
 					fprintf(stderr, "Argument %s is already set\n", argv[optind-1]);
 					goto cleanup_and_die;
@@ -202,6 +442,22 @@ int main(int argc, char **argv)
 		give_usage(argv[0], streamer_name);
 		goto cleanup_and_die;
 	}
+	if (scenario != NULL && streamer_name != NULL) {
+		fprintf(stderr, "Argument --scenario can not be combined with -s\n");
+		goto cleanup_and_die;
+	}
+	if (analysis && (streamer_name != NULL || scenario != NULL)) {
+		fprintf(stderr, "Argument --analyze can not be combined with -s or --scenario\n");
+		goto cleanup_and_die;
+	}
+	if (scenario != NULL && num_streams != 1) {
+		fprintf(stderr, "Argument --scenario can not be combined with -n\n");
+		goto cleanup_and_die;
+	}
+	if (rcv_opts.framed && rcv_opts.discard) {
+		fprintf(stderr, "Argument --framed can not be combined with --discard\n");
+		goto cleanup_and_die;
+	}
 	for (i = 0; streamer_params != NULL && streamer_params[i].name != NULL; ++i) {
 		if (streamer_params[i].flag == NULL && streamer_params[i].val != 0 && streamer_args[i] == NULL) {
 			fprintf(stderr, "Missing argument: --%s\n", streamer_params[i].name);
@@ -218,33 +474,79 @@ int main(int argc, char **argv)
 
 	/* Create socket descriptor and start instance */
 	streamer_state = 1;
-	if (streamer_entry == NULL) {
-		
-		fprintf(stdout, "Starting receiver.\n");
-		if ((sock_fd = create_socket(NULL, port)) < 0) {
-			fprintf(stderr, "Unable to bind to port %s\n", port);
+	if (analysis) {
+
+		/* Analyse capture files instead of running an instance */
+		if (analyze(argv + optind, argc - optind, rcv_opts.workers) < 0)
 			goto cleanup_and_die;
-		}
-		fprintf(stdout, "Accepting connections on port %s\n", port);
 
+	} else if (streamer_name == NULL && scenario == NULL) {
+		
 		/* Start receiver instance */
-		receiver(sock_fd, &streamer_state);
+		fprintf(stdout, "Starting receiver.\n");
+		if (receiver(port, &rcv_opts, &streamer_state) < 0)
+			goto cleanup_and_die;
 
 	} else if (argc - optind > 0) {
 
 		host = argv[optind];
-		fprintf(stdout, "Streamer %s selected.\n", streamer_name);
-		if ((sock_fd = create_socket(host, port)) < 0) {
-			fprintf(stderr, "Unable to connect to %s\n", host);
+		if (scenario != NULL) {
+			if ((num_groups = read_scenario(scenario, &groups)) <= 0) {
+				fprintf(stderr, "Unable to read scenario: %s\n", scenario);
+				goto cleanup_and_die;
+			}
+			if (load_scenario(groups, num_groups) < 0)
+				goto cleanup_and_die;
+
+			for (i = 0, num_streams = 0; i < num_groups; ++i)
+				num_streams += groups[i].count;
+			fprintf(stdout, "Scenario %s loaded (%d flow groups).\n", scenario, num_groups);
+		} else
+			fprintf(stdout, "Streamer %s selected.\n", streamer_name);
+
+		if ((streams = calloc(num_streams, sizeof(stream_t))) == NULL)
 			goto cleanup_and_die;
+
+		if (scenario != NULL)
+			setup_groups(streams, groups, num_groups, stagger, sockopt);
+		else {
+			for (i = 0; i < (int) num_streams; ++i) {
+				streams[i].entry = streamer_entry;
+				streams[i].events = streamer_events;
+				streams[i].args = streamer_args;
+				streams[i].sockopt = sockopt;
+				streams[i].start = i * stagger;
+			}
 		}
 
-		lookup_addr(sock_fd, NULL, &addr);
+		for (connected = 0; connected < num_streams; ++connected) {
+			sock_opts.profile = streams[connected].sockopt;
+			if ((streams[connected].conn = create_socket(host, port, &sock_opts)) < 0) {
+				if (streams[connected].conn == -4)
+					fprintf(stderr, "Unable to apply socket options: %s\n", sock_opts.profile);
+				else
+					fprintf(stderr, "Unable to connect to %s\n", host);
+				goto cleanup_and_die;
+			}
+
+			// log the effective values once for every profile in use
+			if (sock_opts.profile != NULL
+					&& (connected == 0 || streams[connected-1].sockopt == NULL
+						|| strcmp(streams[connected-1].sockopt, sock_opts.profile) != 0)) {
+				fprintf(stdout, "Socket options (%s): ", sock_opts.profile);
+				print_sockopts(streams[connected].conn, stdout);
+			}
+		}
+
+		lookup_addr(streams[0].conn, NULL, &addr);
 		lookup_name(addr, hostname, sizeof(hostname));
-		fprintf(stdout, "Successfully connected to %s\n", hostname);
+		if (num_streams > 1)
+			fprintf(stdout, "Successfully connected %u streams to %s\n", num_streams, hostname);
+		else
+			fprintf(stdout, "Successfully connected to %s\n", hostname);
 
 		/* Start streamer instance */
-		i = streamer(streamer_entry, duration, sock_fd, &streamer_state, streamer_args);
+		i = streamer(streams, num_streams, duration, &streamer_state);
 		fprintf(stdout, "Streamer exited with status code: %d\n", i);
 
 	} else {
@@ -253,11 +555,19 @@ int main(int argc, char **argv)
 	}
 
 	/* Clean up and exit gracefully */
-	if (sock_fd >= 0)
-		close(sock_fd);
+	while (connected-- > 0)
+		close(streams[connected].conn);
+	free(streams);
+	free(all_params);
 	free(streamer_params);
 	free(streamer_args);
 	unload_streamer(handle);
+	while (num_plugins-- > 0) {
+		free(plugins[num_plugins].params);
+		unload_streamer(plugins[num_plugins].handle);
+	}
+	free(plugins);
+	free_scenario(groups, num_groups > 0 ? num_groups : 0);
 
 	exit(0);
 
@@ -267,11 +577,19 @@ cleanup_and_die:
 		fprintf(stderr, "%s\n", strerror(errno));
 	}
 
-	if (sock_fd >= 0)
-		close(sock_fd);
+	while (connected-- > 0)
+		close(streams[connected].conn);
+	free(streams);
+	free(all_params);
 	free(streamer_params);
 	free(streamer_args);
 	unload_streamer(handle);
+	while (num_plugins-- > 0) {
+		free(plugins[num_plugins].params);
+		unload_streamer(plugins[num_plugins].handle);
+	}
+	free(plugins);
+	free_scenario(groups, num_groups > 0 ? num_groups : 0);
 	exit(1);
 }
 
@@ -294,9 +612,25 @@ static void give_usage(char *name, char *streamer)
 				"  -h  "   "        "   "\tShow usage, use in combination with -s for more.\n"
 				"  -p  " U "port"     R "\tUse specified " U "port" R " instead of default port.\n"
 				"  -v  " U "level"    R "\tSet verbosity to " U "level" R " (0=quiet, 1=normal, 2=verbose).\n"
+				"Receiving options:\n"
+				"  -j  " U "workers"  R "\tAccept connections in " U "workers" R " threads sharing the port.\n"
+				"  -u  "   "        "   "\tReceive using io_uring instead of epoll.\n"
+				"  --discard"             "\tDrain connections without copying the data.\n"
+				"  --read-size=" U "bytes" R "\tRead up to " U "bytes" R " per call (default " DEF_2_STR(DEF_READ) ").\n"
+				"  --max-conns=" U "n" R "\tKeep up to " U "n" R " connections per worker (default " DEF_2_STR(DEF_CONNS) ").\n"
+				"  --backlog=" U "n" R "\tQueue up to " U "n" R " pending connections (default " DEF_2_STR(DEF_BACKLOG) ").\n"
+				"  --framed"              "\tMeasure one-way delay of framed messages.\n"
+				"Analysis options:\n"
+				"  --analyze " U "files" R "\tReport RTT, dupACKs and retransmissions of the flows in pcap " U "files" R ",\n"
+				"            "            "\tusing -j " U "workers" R " threads (default one per core).\n"
 				"Streaming options:\n"
 				"  -s  " U "streamer" R "\tSelect " U "streamer" R ".\n"
 				"  -t  " U "duration" R "\tRun streamer for " U "duration" R " (seconds).\n"
+				"  -n  " U "streams"  R "\tRun " U "streams" R " concurrent connections of the streamer.\n"
+				"  --stagger=" U "ms" R "\tStart each stream " U "ms" R " milliseconds after the previous.\n"
+				"  --scenario=" U "file" R "\tRun the flow groups listed in " U "file" R " instead of -s.\n"
+				"  --sockopt=" U "profile" R "\tSet up connections with the socket option " U "profile" R ",\n"
+				"            "              "\te.g. thin,congestion=reno (see sockopt_t in utils.h).\n"
 				,
 				name, name);
 	} else {
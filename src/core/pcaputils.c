@@ -1,12 +1,14 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <net/if.h>
 #include <pcap.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include "utils.h"
+#include "capture.h"
 #include "debug.h"
 
 
@@ -55,29 +57,13 @@ int lookup_dev(int sock_desc, char *dev, int len)
 
 
 
-/* Create and compile a filter string for the pcap capture filter handle.
- * Will set up a filter that only captures packets belonging to the the
- * stream indicated by socket.
- *
- * Returns 0 on success, and a negative value on failure.
- */
-static int compile_filter(const char *dev, pcap_t *handle, int conn, struct bpf_program *progcode)
+/* Write the filter expression matching the segments of a connection */
+int conn_filter(int conn, char *expr, size_t len)
 {
 	struct sockaddr_in loc_addr, rem_addr; // the addresses and ports of this connection
 	char loc_host[INET_ADDRSTRLEN],        // the hostname of "this side" of the connection
 		 rem_host[INET_ADDRSTRLEN];        // the hostname of the "other side" of the connection
 	unsigned short loc_port, rem_port;     // the ports of this connection
-	char *filterstr = NULL;                // the filter string
-	bpf_u_int32 netmask, netaddr;          // the network mask and network address
-	char errstr[PCAP_ERRBUF_SIZE];         // used to store error messages from libpcap
-
-
-	/* get device properties */
-	if (pcap_lookupnet(dev, &netaddr, &netmask, errstr) == -1) {
-		dbgerr(errstr);
-		return -1;
-	}
-
 
 	/* get hostnames and ports */
 	if (lookup_addr(conn, &loc_addr, &rem_addr) < 0)
@@ -92,136 +78,590 @@ static int compile_filter(const char *dev, pcap_t *handle, int conn, struct bpf_
 	loc_port = ntohs(loc_addr.sin_port);
 	rem_port = ntohs(rem_addr.sin_port);
 
-
 	/* create filter string */
-	if ((filterstr = malloc(512 /* ought to be enough */)) == NULL) {
-		dbgerr(NULL);
-		return -3;
-	}
-	memset(filterstr, 0, 512);
-	snprintf(filterstr, 512,
-			"tcp and ("
+	if ((size_t) snprintf(expr, len,
 			"(dst host %s and dst port %d and src host %s and src port %d)"
-			"or (src host %s and src port %d and dst host %s and dst port %d)"
-			")",
-			loc_host, loc_port, rem_host, rem_port, loc_host, loc_port, rem_host, rem_port);
+			" or (src host %s and src port %d and dst host %s and dst port %d)",
+			loc_host, loc_port, rem_host, rem_port, loc_host, loc_port, rem_host, rem_port) >= len)
+		return -3;
+
+	return 0;
+}
 
 
+
+/* Compile a filter expression for the pcap capture filter handle.
+ *
+ * Returns 0 on success, and a negative value on failure.
+ */
+static int compile_filter(const char *dev, pcap_t *handle, char const *expr, struct bpf_program *progcode)
+{
+	bpf_u_int32 netmask, netaddr;          // the network mask and network address
+	char errstr[PCAP_ERRBUF_SIZE];         // used to store error messages from libpcap
+
+	/* get device properties */
+	if (pcap_lookupnet(dev, &netaddr, &netmask, errstr) == -1) {
+		dbgerr(errstr);
+		return -1;
+	}
+
 	/* compile filter */
-	if (pcap_compile(handle, progcode, filterstr, 0, netaddr) == -1) {
+	if (pcap_compile(handle, progcode, expr, 0, netaddr) == -1) {
 		pcap_perror(handle, "Unexpected error");
-		free(filterstr);
 		return -4;
 	}
 
-	free(filterstr);
 	return 0;
 }
 
 
 
-/* Create a custom pcap capture filter handle and return it */
-int create_handle(pcap_t** handle, int sock, int timeout)
+/* Compile a filter for the packet ring */
+static int compile_ring_filter(struct capture *cap, char const *expr, struct bpf_program *progcode)
 {
-	char errstr[PCAP_ERRBUF_SIZE];
-	char dev[15];
-	struct bpf_program filter;
+	pcap_t *dead;
+	int status;
 
-	/* look up device */
-	if (lookup_dev(sock, dev, sizeof(dev)))
+	if ((dead = pcap_open_dead(cap->linktype, CAPTURE_SNAPLEN)) == NULL)
 		return -1;
 
+	status = compile_filter(cap->dev, dead, expr, progcode);
+	pcap_close(dead);
+	return status;
+}
+
+
+
+/* Capture through libpcap, for devices the packet ring doesn't support */
+static int open_pcap(struct capture *cap, char const *expr)
+{
+	char errstr[PCAP_ERRBUF_SIZE];
+
 	/* create a pcap capture handle */
-	if ((*handle = pcap_open_live(dev, 0xffff, 1, timeout, errstr)) == NULL) {
+	if ((cap->pcap = pcap_create(cap->dev, errstr)) == NULL) {
 		dbgerr(errstr);
 		return -2;
 	}
 
-	/* create and apply filter string */
-	if (compile_filter(dev, *handle, sock, &filter))
+	// immediate mode hands over every frame at once, instead of whole buffers after the timeout
+	if (pcap_set_snaplen(cap->pcap, CAPTURE_SNAPLEN) != 0 || pcap_set_timeout(cap->pcap, cap->timeout) != 0
+			|| pcap_set_immediate_mode(cap->pcap, 1) != 0 || pcap_activate(cap->pcap) < 0) {
+		dbgerr(pcap_geterr(cap->pcap));
+		pcap_close(cap->pcap);
+		return -2;
+	}
+
+	cap->backend = CAPTURE_PCAP;
+	cap->linktype = pcap_datalink(cap->pcap);
+	if ((cap->decode = find_decoder(cap->linktype, NULL)) == NULL || set_filter(cap, expr) < 0) {
+		pcap_close(cap->pcap);
 		return -3;
+	}
 
-	if (pcap_setfilter(*handle, &filter) == -1) {
-		pcap_perror(*handle, "Unexpected error");
-		pcap_freecode(&filter);
-		return -4;
+	return 0;
+}
+
+
+
+/* Capture through a packet ring */
+static int open_ring(struct capture *cap, char const *expr)
+{
+	int status;
+
+	if ((status = tpacket_open(cap, cap->dev)) < 0)
+		return status;
+
+	// nothing is captured until the filter is set
+	cap->backend = CAPTURE_RING;
+	if ((cap->decode = find_decoder(cap->linktype, NULL)) == NULL || set_filter(cap, expr) < 0) {
+		tpacket_close(cap);
+		return -3;
+	}
+
+	return 0;
+}
+
+
+
+/* Open a capture handle on a device */
+int open_capture(capture_t **handle, char const *dev, char const *expr, int timeout)
+{
+	int status;
+
+	if ((*handle = calloc(1, sizeof(capture_t))) == NULL)
+		return -2;
+	(*handle)->timeout = timeout;
+	strncpy((*handle)->dev, dev, sizeof((*handle)->dev) - 1);
+
+	/* prefer the packet ring, and fall back to libpcap */
+	if (open_ring(*handle, expr) < 0 && (status = open_pcap(*handle, expr)) < 0) {
+		free(*handle);
+		*handle = NULL;
+		return status;
+	}
+
+	return 0;
+}
+
+
+
+/* Replace the filter of a capture handle */
+int set_filter(capture_t *handle, char const *expr)
+{
+	struct bpf_program filter;
+	int status;
+
+	if (handle->backend == CAPTURE_RING) {
+		if (compile_ring_filter(handle, expr, &filter))
+			return -3;
+		status = tpacket_filter(handle, &filter);
+
+	} else {
+		if (compile_filter(handle->dev, handle->pcap, expr, &filter))
+			return -3;
+		if ((status = pcap_setfilter(handle->pcap, &filter)) == -1)
+			pcap_perror(handle->pcap, "Unexpected error");
 	}
 
 	pcap_freecode(&filter);
+	return status < 0 ? -4 : 0;
+}
+
+
+
+/* Create a capture filter handle and return it */
+int create_handle(capture_t** handle, int sock, int timeout)
+{
+	char dev[IF_NAMESIZE];
+	char expr[CAPTURE_FILTER_LEN];
+	int status;
+
+	/* look up device */
+	if (lookup_dev(sock, dev, sizeof(dev)))
+		return -1;
+
+	/* create filter string */
+	strcpy(expr, "tcp and (");
+	if (conn_filter(sock, expr + strlen(expr), sizeof(expr) - strlen(expr) - 1) < 0)
+		return -3;
+	strcat(expr, ")");
+
+	if ((status = open_capture(handle, dev, expr, timeout)) < 0)
+		return status;
+
+	lookup_addr(sock, &(*handle)->local, NULL);
 	return 0;
 }
 
 
 
-/* Process a packet captured by the pcap capture filter */
-int parse_segment(pcap_t *handle, pkt_t *packet)
+/* Load a 16-bit field in network byte order, wherever it is aligned */
+static inline uint16_t load16(uint8_t const *field)
+{
+	uint16_t value;
+	memcpy(&value, field, sizeof(value));
+	return ntohs(value);
+}
+
+
+
+/* Load a 32-bit field in network byte order, wherever it is aligned */
+static inline uint32_t load32(uint8_t const *field)
+{
+	uint32_t value;
+	memcpy(&value, field, sizeof(value));
+	return ntohl(value);
+}
+
+
+
+/* Decode the IPv4 and TCP headers starting at offset off */
+static inline int decode_ipv4(uint8_t const *frame, uint32_t caplen, uint32_t off, struct headers *hdrs)
+{
+	uint8_t const *ip = frame + off, *tcp;
+	uint32_t ip_len, tcp_len, tot_len;
+
+	// the fixed parts of both headers must be captured, and it must be IPv4 carrying TCP
+	if (caplen < off + 40 || (ip[0] >> 4) != 4 || ip[9] != IPPROTO_TCP)
+		return 0;
+
+	ip_len = (ip[0] & 0x0f) * 4; // IP header size (offset to TCP header)
+	if (ip_len < 20 || caplen < off + ip_len + 20)
+		return 0;
+
+	tcp = ip + ip_len;
+	tcp_len = (tcp[12] >> 4) * 4; // TCP header size (offset to TCP payload)
+	tot_len = load16(ip + 2);
+	if (tcp_len < 20 || tot_len < ip_len + tcp_len)
+		return 0;
+
+	/* discard if SYN flag set (connection handshake) */
+	if (tcp[13] & 0x02)
+		return 0;
+
+	// addresses and ports are kept in network byte order
+	memcpy(&hdrs->saddr, ip + 12, sizeof(hdrs->saddr));
+	memcpy(&hdrs->daddr, ip + 16, sizeof(hdrs->daddr));
+	memcpy(&hdrs->sport, tcp, sizeof(hdrs->sport));
+	memcpy(&hdrs->dport, tcp + 2, sizeof(hdrs->dport));
+
+	hdrs->seq = load32(tcp + 4);
+	hdrs->ack = load32(tcp + 8);
+	hdrs->win = load16(tcp + 14);
+	hdrs->len = tot_len - ip_len - tcp_len;
+	hdrs->payload = tcp + tcp_len;
+	return 1;
+}
+
+
+
+/* Decode an Ethernet frame, skipping any 802.1Q/802.1ad tags */
+static int decode_ether(uint8_t const *frame, uint32_t caplen, struct headers *hdrs)
+{
+	uint32_t off = 12;
+	uint16_t type;
+
+	if (caplen < 14)
+		return 0;
+
+	type = load16(frame + off);
+	while ((type == 0x8100 || type == 0x88a8) && caplen >= off + 8) {
+		off += 4;
+		type = load16(frame + off);
+	}
+
+	return type == 0x0800 ? decode_ipv4(frame, caplen, off + 2, hdrs) : 0;
+}
+
+
+
+/* Decode a Linux cooked capture (v1) frame */
+static int decode_sll(uint8_t const *frame, uint32_t caplen, struct headers *hdrs)
+{
+	return caplen >= 16 && load16(frame + 14) == 0x0800 ? decode_ipv4(frame, caplen, 16, hdrs) : 0;
+}
+
+
+
+/* Decode a Linux cooked capture (v2) frame */
+static int decode_sll2(uint8_t const *frame, uint32_t caplen, struct headers *hdrs)
+{
+	return caplen >= 20 && load16(frame) == 0x0800 ? decode_ipv4(frame, caplen, 20, hdrs) : 0;
+}
+
+
+
+/* Decode a raw IP packet */
+static int decode_raw(uint8_t const *frame, uint32_t caplen, struct headers *hdrs)
+{
+	return decode_ipv4(frame, caplen, 0, hdrs);
+}
+
+
+
+/* Decode a BSD loopback frame, where the address family is in either byte order */
+static int decode_null(uint8_t const *frame, uint32_t caplen, struct headers *hdrs)
+{
+	return caplen >= 4 && (load32(frame) == 2 || load32(frame) == 0x02000000) ? decode_ipv4(frame, caplen, 4, hdrs) : 0;
+}
+
+
+
+/* Find the decoder for a link type */
+decoder_t find_decoder(int linktype, char const **name)
+{
+	static char const *names[] = { "Ethernet", "Linux cooked", "Linux cooked v2", "raw IP", "loopback" };
+	static decoder_t const decoders[] = { &decode_ether, &decode_sll, &decode_sll2, &decode_raw, &decode_null };
+	int i;
+
+	switch (linktype) {
+		case LINK_ETHERNET:
+			i = 0;
+			break;
+
+		case LINK_SLL:
+			i = 1;
+			break;
+
+		case LINK_SLL2:
+			i = 2;
+			break;
+
+		case LINK_RAW:
+		case LINK_IPV4:
+		case DLT_RAW:
+			i = 3;
+			break;
+
+		case LINK_NULL:
+		case LINK_LOOP:
+			i = 4;
+			break;
+
+		default:
+			return NULL;
+	}
+
+	if (name != NULL)
+		*name = names[i];
+	return decoders[i];
+}
+
+
+
+/* Load a segment with decoded headers */
+static void load_segment(struct headers const *hdrs, struct timeval ts, pkt_t *packet)
+{
+	/* load struct with header data */
+	memset(&packet->src, 0, sizeof(struct sockaddr_in));
+	memset(&packet->dst, 0, sizeof(struct sockaddr_in));
+	packet->ts = ts;
+	packet->src.sin_family = AF_INET;
+	packet->src.sin_addr.s_addr = hdrs->saddr;
+	packet->src.sin_port = hdrs->sport;
+	packet->dst.sin_family = AF_INET;
+	packet->dst.sin_addr.s_addr = hdrs->daddr;
+	packet->dst.sin_port = hdrs->dport;
+	packet->win = hdrs->win;
+	packet->seq = hdrs->seq;
+	packet->ack = hdrs->ack;
+	packet->len = hdrs->len;
+	packet->payload = hdrs->payload;
+}
+
+
+
+/* Decode the headers of a captured segment */
+int decode_segment(int linktype, uint8_t const *frame, uint32_t caplen, struct timeval ts, pkt_t *packet)
+{
+	struct headers hdrs;
+	decoder_t decode;
+
+	if ((decode = find_decoder(linktype, NULL)) == NULL)
+		return -1;
+
+	if (decode(frame, caplen, &hdrs) == 0)
+		return 0;
+
+	load_segment(&hdrs, ts, packet);
+	return 1;
+}
+
+
+
+/* Make libpcap wait for its timeout when its buffer is empty, or not */
+static int set_wait(capture_t *handle, int wait)
+{
+	char errstr[PCAP_ERRBUF_SIZE];
+
+	if (handle->nonblock != wait)
+		return 0;
+
+	if (pcap_setnonblock(handle->pcap, !wait, errstr) == -1) {
+		dbgerr(errstr);
+		return -1;
+	}
+
+	handle->nonblock = !wait;
+	return 0;
+}
+
+
+
+/* Fetch the next captured frame */
+int capture_frame(capture_t *handle, int wait, struct captured *frame)
 {
 	struct pcap_pkthdr *hdr;
 	const u_char *pkt;
 	int status;
-	struct sockaddr_in src_addr, dst_addr;
-	uint32_t ack_no, seq_no, tcp_off, data_off;
-	uint16_t win_sz, len;
-   
-	/* read next packet */
-	status = pcap_next_ex(handle, &hdr, &pkt);
+
+	if (handle->backend == CAPTURE_RING)
+		return tpacket_frame(handle, wait ? handle->timeout : 0, frame);
+
+	if (set_wait(handle, wait) < 0)
+		return -1;
+
+	status = pcap_next_ex(handle->pcap, &hdr, &pkt);
 	if (status < 0) {
-		pcap_perror(handle, "Unexpected error");
+		pcap_perror(handle->pcap, "Unexpected error");
+		return -1;
+	}
+
+	if (status == 0)
+		return 0;
+
+	frame->data = pkt;
+	frame->caplen = hdr->caplen;
+	frame->wirelen = hdr->len;
+	frame->ts = hdr->ts.tv_sec * 1000000000ULL + hdr->ts.tv_usec * 1000ULL;
+	return 1;
+}
+
+
+
+/* Process a packet captured by the capture filter */
+int parse_segment(capture_t *handle, pkt_t *packet)
+{
+	struct captured frame;
+	struct headers hdrs;
+	struct timeval ts;
+	int status;
+
+	if ((status = capture_frame(handle, 1, &frame)) <= 0)
+		return status;
+
+	if (handle->decode(frame.data, frame.caplen, &hdrs) == 0)
+		return 0;
+
+	ts.tv_sec = frame.ts / 1000000000ULL;
+	ts.tv_usec = frame.ts % 1000000000ULL / 1000;
+	load_segment(&hdrs, ts, packet);
+	return 1;
+}
+
+
+
+/* Add a decoded segment to a batch */
+static void add_segment(capture_t *handle, segbatch_t *batch, uint8_t const *frame, uint32_t caplen, uint64_t ts)
+{
+	struct headers hdrs;
+	size_t i = batch->count;
+
+	if (handle->decode(frame, caplen, &hdrs) == 0)
+		return;
+
+	batch->ts[i] = ts;
+	batch->seq[i] = hdrs.seq;
+	batch->ack[i] = hdrs.ack;
+	batch->win[i] = hdrs.win;
+	batch->len[i] = hdrs.len;
+	batch->dir[i] = hdrs.saddr == handle->local.sin_addr.s_addr && hdrs.sport == handle->local.sin_port;
+	batch->count = i + 1;
+}
+
+
+
+/* Batch filled by pcap_dispatch() */
+struct dispatch
+{
+	capture_t *handle;
+	segbatch_t *batch;
+};
+
+
+
+/* Called by pcap_dispatch() for every captured frame */
+static void dispatch_segment(u_char *user, struct pcap_pkthdr const *hdr, u_char const *pkt)
+{
+	struct dispatch *arg = (struct dispatch*) user;
+
+	if (arg->batch->count < arg->batch->size)
+		add_segment(arg->handle, arg->batch, pkt, hdr->caplen,
+				hdr->ts.tv_sec * 1000000000ULL + hdr->ts.tv_usec * 1000ULL);
+}
+
+
+
+/* Parse a batch of segments captured by the capture filter */
+int parse_segments(capture_t *handle, segbatch_t *batch)
+{
+	struct dispatch arg = { handle, batch };
+	struct captured frame;
+	int status;
+
+	batch->count = 0;
+
+	/* libpcap delivers up to one buffer of frames per call */
+	if (handle->backend == CAPTURE_PCAP) {
+		if (set_wait(handle, 1) < 0)
+			return -1;
+		if (pcap_dispatch(handle->pcap, batch->size, &dispatch_segment, (u_char*) &arg) < 0) {
+			pcap_perror(handle->pcap, "Unexpected error");
+			return -1;
+		}
+		return batch->count;
+	}
+
+	/* only wait while the batch is empty */
+	while (batch->count < batch->size) {
+		if ((status = tpacket_frame(handle, batch->count == 0 ? handle->timeout : 0, &frame)) < 0)
+			return -1;
+		if (status == 0)
+			break;
+
+		add_segment(handle, batch, frame.data, frame.caplen, frame.ts);
+	}
+
+	return batch->count;
+}
+
+
+
+/* Allocate the columns of a segment batch */
+int segbatch_init(segbatch_t *batch, size_t size)
+{
+	memset(batch, 0, sizeof(segbatch_t));
+
+	// every column starts on its own cache line
+	if (posix_memalign((void**) &batch->ts, SEGBATCH_ALIGN, sizeof(uint64_t) * size) != 0
+			|| posix_memalign((void**) &batch->seq, SEGBATCH_ALIGN, sizeof(uint32_t) * size) != 0
+			|| posix_memalign((void**) &batch->ack, SEGBATCH_ALIGN, sizeof(uint32_t) * size) != 0
+			|| posix_memalign((void**) &batch->win, SEGBATCH_ALIGN, sizeof(uint16_t) * size) != 0
+			|| posix_memalign((void**) &batch->len, SEGBATCH_ALIGN, sizeof(uint16_t) * size) != 0
+			|| posix_memalign((void**) &batch->dir, SEGBATCH_ALIGN, sizeof(uint8_t) * size) != 0) {
+		segbatch_free(batch);
+		return -1;
+	}
+
+	batch->size = size;
+	return 0;
+}
+
+
+
+/* Free the columns of a segment batch */
+void segbatch_free(segbatch_t *batch)
+{
+	free(batch->ts);
+	free(batch->seq);
+	free(batch->ack);
+	free(batch->win);
+	free(batch->len);
+	free(batch->dir);
+	memset(batch, 0, sizeof(segbatch_t));
+}
+
+
+
+/* Get capture statistics */
+int capture_stats(capture_t *handle, capstats_t *stats)
+{
+	struct pcap_stat ps;
+
+	if (handle->backend == CAPTURE_RING)
+		return tpacket_stats(handle, stats);
+
+	if (pcap_stats(handle->pcap, &ps) == -1)
 		return -1;
-	} 
-
-	/* load segment metadata */
-	// FIXME: This test is probably unnecessary as only TCP segments should be captured by filter anyway
-	if (status == 1
-			// length >= minimum length of eth frame, IP header and TCP header?
-			&& (hdr->len >= ETH_FRAME_LEN+20+20) 
-			// IP version 4?
-			&& ((*((uint8_t*) (pkt+ETH_FRAME_LEN)) & 0xf0) >> 4) == 4
-			// protocl = TCP?
-			&& *((uint8_t*) (pkt+ETH_FRAME_LEN+9)) == 6
-	   ) {
-
-		/* read header data */
-		tcp_off = (*((uint8_t*) pkt + ETH_FRAME_LEN) & 0x0f) * 4; // IP header size (offset to IP payload / TCP header)
-		data_off = ((*((uint8_t*) (pkt + ETH_FRAME_LEN + tcp_off + 12)) & 0xf0) >> 4) * 4; // TCP header size (offset to TCP payload)
-
-		src_addr.sin_addr = *((struct in_addr*) (pkt + ETH_FRAME_LEN + 12)); // source address
-		src_addr.sin_port = *((uint16_t*) (pkt + ETH_FRAME_LEN + tcp_off)); // source port
-		dst_addr.sin_addr = *((struct in_addr*) (pkt + ETH_FRAME_LEN + 16)); // destination address
-		dst_addr.sin_port = *((uint16_t*) (pkt + ETH_FRAME_LEN + tcp_off + 2)); // destination port
-
-		seq_no = ntohl(*((uint32_t*) (pkt + ETH_FRAME_LEN + tcp_off + 4))); // sequence number
-		ack_no = ntohl(*((uint32_t*) (pkt + ETH_FRAME_LEN + tcp_off + 8))); // acknowledgement number
-
-		win_sz = ntohl(*((uint16_t*) (pkt + ETH_FRAME_LEN + tcp_off + 14))); // window size
-
-		len = ntohs(*((uint16_t*) (pkt + ETH_FRAME_LEN + 2))) - tcp_off - data_off; // payload length
-
-		/* discard if SYN or FIN flag set (connection handshake/teardown) */
-		if ((*((uint8_t*) (pkt + ETH_FRAME_LEN + tcp_off + 13)) & 0x02))
-			return 0;
-		
-
-		/* load struct with header data */
-		packet->ts = hdr->ts;
-		packet->dst = dst_addr;
-		packet->src = src_addr;
-		packet->seq = seq_no;
-		packet->ack = ack_no;
-		packet->len = len;
-		packet->payload = (void const*) ((uint8_t*) (pkt + ETH_FRAME_LEN + tcp_off + data_off)); // FIXME: Verify that this is correct
-
-		return 1;
-	} 
 
+	stats->packets = ps.ps_recv;
+	stats->drops = ps.ps_drop + ps.ps_ifdrop;
+	stats->freezes = 0;
+	stats->overruns = 0;
 	return 0;
 }
 
 
 
-/* Free up any resources associated with the pcap capture filter */
-void destroy_handle(pcap_t *handle)
+/* Free up any resources associated with the capture filter */
+void destroy_handle(capture_t *handle)
 {
-	if (handle != NULL)
-		pcap_close(handle);
+	if (handle == NULL)
+		return;
+
+	if (handle->backend == CAPTURE_RING)
+		tpacket_close(handle);
+	else
+		pcap_close(handle->pcap);
+	free(handle);
 }
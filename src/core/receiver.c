@@ -1,192 +1,347 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include "instance.h"
 #include "utils.h"
+#include "receiver.h"
+#include "logger.h"
 
 
+/* Maximum number of events handled per epoll_wait() call */
+#define MAX_EVENTS 64
 
-/* Reject connection (accept+close socket) */
-static void reject_connection(int listen_sock)
+/* Event data of the listening socket (connections use their table slot) */
+#define LISTEN_TAG ((uint64_t) -1)
+
+
+
+/* Current time in nanoseconds (CLOCK_MONOTONIC) */
+static uint64_t now_ns(void)
 {
-	int sock_fd;
-	sock_fd = accept(listen_sock, NULL, NULL);
-	close(sock_fd);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 
 
-/* Accept connection */
-static int accept_connection(int listen_sock, struct sockaddr_in *addr, int *sock)
+/* Estimate when the SYN arrived */
+void stamp_syn(struct conn *conn)
 {
-	int recv_sock, status;
-	socklen_t len = sizeof(struct sockaddr_in);
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
 
-	/* accept connection */
-	recv_sock = accept(listen_sock, (struct sockaddr*) addr, &len);
-	if (recv_sock == -1) {
-		perror("accept");
-		return -1;
+	conn->syn = now_ns();
+	if (getsockopt(conn->sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+		// time spent in the accept queue (ms) and the SYN-ACK round-trip (us)
+		conn->syn -= info.tcpi_last_ack_recv * 1000000ULL + info.tcpi_rtt * 1000ULL;
 	}
+}
+
+
 
-	/* set socket to non-blocking */
-	status = fcntl(recv_sock, F_GETFL, 0);
-	fcntl(recv_sock, F_SETFL, status | O_NONBLOCK);
+/* Record connection setup time */
+void stamp_first_byte(struct worker *w, struct conn *conn)
+{
+	uint64_t setup = now_ns() - conn->syn;
 
-	/* return socket descriptor */
-	*sock = recv_sock;
-	return *sock;
+	w->setup_sum += setup;
+	w->setup_max = setup > w->setup_max ? setup : w->setup_max;
+	++w->setups;
 }
 
 
 
-/* Accept connections and read data from them */
-void receiver(int listen_sock, int *run)
+/* Close a connection */
+void close_conn(struct worker *w, struct table *table, struct conn *conn)
 {
-	struct conn {
-		struct sockaddr_in addr; // address of the remote side of the connection
-		int                sock; // conn socket descriptor
-		ssize_t            rcvd; // number of bytes received from connection
-		struct conn*       next; // next connection
-		struct conn*       prev; // previous connection
-	} *list = NULL, *ptr, *tmp;
+	hist_t *hist;
+
+	log_event(w->id, LOG_CLOSE, conn->name, table->rcvd[conn->slot]);
+
+	if (table->hists != NULL) {
+		hist = &table->hists[conn->slot];
+		if (hist->count > 0)
+			log_delay(w->id, conn->name, hist);
 
+		hist_merge(&w->delays, hist);
+		w->early += table->framers[conn->slot].early;
+	}
+
+	close(conn->sock); // also removes it from an event descriptor
+	remove_conn(table, conn);
+}
+
+
+
+/* Accept connections and read data from them */
+void* epoll_worker(struct worker *w)
+{
+	int listen_sock = w->sock;
+	struct table table;
+	struct conn *ptr;
+	struct sockaddr_in addr;
+	socklen_t addrlen;
+	struct epoll_event ev, events[MAX_EVENTS];
 	char name[INET_ADDRSTRLEN];
 	void *buf = NULL;
 	ssize_t rcvd, tot_rcvd;
-	int hi_sock, num_active;
-	fd_set socks, active;
-	struct timeval wait = {0, 0};
+	int efd, i, sock, status, num_active;
 
-	/* Allocate buffer */
-	if ((buf = malloc(sizeof(char) * 1460)) == NULL) {
+	/* Allocate buffer (not needed when data is discarded in the kernel) */
+	if (!w->discard && (buf = malloc(sizeof(char) * w->rdsz)) == NULL) {
 		perror("malloc");
-		return;
+		return NULL;
 	}
 
-	/* Initialize descriptor set */
-	FD_ZERO(&socks);
-	FD_SET(listen_sock, &socks);
-	hi_sock = listen_sock;
-	
-	while (*run) {
+	if (create_table(&table, w->capacity, w->framed) < 0) {
+		perror("create_table");
+		free(buf);
+		return NULL;
+	}
 
-		active = socks;
-		if ((num_active = select(hi_sock + 1, &active, NULL, NULL, &wait)) == -1) 
+	/* Create event descriptor and register listening socket.
+	 * The listening socket is level-triggered, so that pending connections
+	 * not accepted in one round will be reported again in the next, and
+	 * non-blocking, so that the accept queue can be drained until empty.
+	 */
+	status = fcntl(listen_sock, F_GETFL, 0);
+	fcntl(listen_sock, F_SETFL, status | O_NONBLOCK);
+
+	if ((efd = epoll_create1(0)) == -1) {
+		perror("epoll_create1");
+		destroy_table(&table);
+		free(buf);
+		return NULL;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.u64 = LISTEN_TAG;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, listen_sock, &ev) == -1) {
+		perror("epoll_ctl");
+		close(efd);
+		destroy_table(&table);
+		free(buf);
+		return NULL;
+	}
+
+	while (*w->run) {
+
+		++w->calls;
+		if ((num_active = epoll_wait(efd, events, MAX_EVENTS, POLL_TIMEOUT)) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
 			break;
+		}
 
-		/* Accept incomming connection */
-		if (FD_ISSET(listen_sock, &active)) {
-			
-			/* allocate new connection */
-			for (ptr = list; ptr != NULL && ptr->next != NULL; ptr = ptr->next);
-			if (ptr == NULL) {
-				if ((list = malloc(sizeof(struct conn))) == NULL) {
-					perror("malloc");
-					reject_connection(listen_sock);
-					break;
-				}
+		for (i = 0; i < num_active; ++i) {
 
-				ptr = list;
-				ptr->next = NULL;
-				ptr->prev = NULL;
+			/* Accept all pending connections */
+			if (events[i].data.u64 == LISTEN_TAG) {
 
-			} else {
-				if ((ptr->next = malloc(sizeof(struct conn))) == NULL) {
-					perror("malloc");
-					reject_connection(listen_sock);
-					break;
+				addrlen = sizeof(addr);
+				while ((sock = accept4(listen_sock, (struct sockaddr*) &addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+					addrlen = sizeof(addr);
+					++w->calls;
+
+					// take a slot for the new connection
+					if ((ptr = insert_conn(&table, sock)) == NULL) {
+						lookup_name(addr, name, sizeof(name));
+						log_event(w->id, LOG_REJECT, name, 0);
+						close(sock);
+						continue;
+					}
+					ptr->addr = addr;
+					stamp_syn(ptr);
+
+					ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+					ev.data.u64 = ptr->slot;
+					++w->calls;
+					if (epoll_ctl(efd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+						perror("epoll_ctl");
+						close(sock);
+						remove_conn(&table, ptr);
+						continue;
+					}
+					++w->conns;
+
+					lookup_name(ptr->addr, ptr->name, sizeof(ptr->name));
+					log_event(w->id, LOG_ACCEPT, ptr->name, 0);
 				}
+				++w->calls;
 
-				ptr->next->prev = ptr;
-				ptr->next->next = NULL;
-				ptr = ptr->next;
+				if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR)
+					perror("accept4");
+				continue;
 			}
 
-			// set up new connection
-			if (accept_connection(listen_sock, &(ptr->addr), &(ptr->sock)) < 0)
-				break; // something is wrong
-			
-			ptr->rcvd = 0;
+			/* Read data from the connection */
+			ptr = &table.conns[events[i].data.u64];
+			if (ptr->sock < 0)
+				continue;
+
+			// read data from socket descriptor until it would block (edge-triggered),
+			// with MSG_TRUNC a TCP socket drops the data instead of copying it
+			tot_rcvd = 0;
+			while ((rcvd = recv(ptr->sock, buf, sizeof(char) * w->rdsz, w->discard ? MSG_TRUNC : 0)) > 0) {
+				tot_rcvd += rcvd;
+				++w->calls;
+
+				if (w->framed)
+					parse_frames(&table.framers[ptr->slot], &table.hists[ptr->slot], buf, rcvd, frame_clock());
+			}
+			if (table.rcvd[ptr->slot] == 0 && tot_rcvd > 0)
+				stamp_first_byte(w, ptr);
+			table.rcvd[ptr->slot] += tot_rcvd;
+			w->bytes += tot_rcvd;
+			++w->calls;
 
-			lookup_name(ptr->addr, name, sizeof(name));
-			fprintf(stdout, "Accepted connection from %s\n", name);
+			log_event(w->id, LOG_RECV, ptr->name, tot_rcvd);
 
-			/* update descriptor set */
-			FD_SET(ptr->sock, &socks);
-			hi_sock = ptr->sock > hi_sock ? ptr->sock : hi_sock;
-			--num_active;
+			// close connection
+			if (rcvd == 0 || (rcvd < 0 && errno != EAGAIN))
+				close_conn(w, &table, ptr);
 		}
+	}
 
+	/* Free resources */
+	for (i = 0; i < (int) table.capacity; ++i)
+		if (table.conns[i].sock >= 0)
+			close_conn(w, &table, &table.conns[i]);
 
-		/* Read data from the connections */
-		ptr = list;
-		while (num_active > 0 && ptr != NULL) {
+	free(buf);
+	destroy_table(&table);
+	close(efd);
+	return NULL;
+}
 
-			if (FD_ISSET(ptr->sock, &active)) {
 
-				/* read data from socket descriptor */
-				tot_rcvd = 0;
-				while ((rcvd = read(ptr->sock, buf, sizeof(char) * 1460)) > 0) {
-					tot_rcvd += rcvd;
-					ptr->rcvd += rcvd;
-				}
 
-				lookup_name(ptr->addr, name, sizeof(name));
-				fprintf(stdout, "Received %ld bytes from %s\n", tot_rcvd, name);
-				
-				/* close connection */
-				if (rcvd == 0 || (rcvd < 0 && errno != EAGAIN)) {
-					fprintf(stdout, "Closing connection from %s\n", name);
-
-					// remove socket descriptor from file descriptor set
-					close(ptr->sock);
-					FD_CLR(ptr->sock, &socks);
-
-					// remove connection from connection list
-					if (ptr->next != NULL)
-						ptr->next->prev = ptr->prev;
-
-					if (ptr->prev == NULL) {
-						tmp = list;
-						list = list->next;
-						free(tmp);
-
-						if (list == NULL)
-							break;
-						else {
-							ptr = list;
-							continue;
-						}
-
-					} else {
-						ptr->prev->next = ptr->next;
-						ptr->prev->prev = ptr->prev;
-						tmp = ptr;
-						ptr = ptr->prev;
-						free(tmp);
-					}
-				}
+/* Start receiver workers and merge their counters when they are done */
+int receiver(char const *port, rcv_opts_t const *opts, int *run)
+{
+	struct worker *workers;
+	sockopt_t sock_opts = { 0 };
+	struct timespec start, end;
+	void* (*engine)(struct worker*) = &epoll_worker;
+	uint64_t bytes = 0, calls = 0, setup_sum = 0, setup_max = 0, early = 0;
+	unsigned i, n, conns = 0, setups = 0;
+	hist_t delays;
+	double secs;
+
+	n = opts != NULL && opts->workers > 1 ? opts->workers : 1;
+	if ((workers = calloc(n, sizeof(struct worker))) == NULL) {
+		perror("calloc");
+		return -1;
+	}
 
-				--num_active;
-			}
+	if (opts != NULL && opts->engine == RCV_URING)
+		engine = &uring_worker;
+
+	/* Create a listening socket for every worker */
+	sock_opts.reuse_port = n > 1;
+	sock_opts.backlog = opts != NULL ? opts->backlog : 0;
+	for (i = 0; i < n; ++i) {
+		workers[i].id = i;
+		workers[i].run = run;
+		workers[i].rdsz = opts != NULL && opts->rdsz > 0 ? opts->rdsz : DEF_READ;
+		workers[i].capacity = opts != NULL && opts->capacity > 0 ? opts->capacity : DEF_CONNS;
+		workers[i].discard = opts != NULL && opts->discard;
+		workers[i].framed = opts != NULL && opts->framed;
+		hist_init(&workers[i].delays);
+		if ((workers[i].sock = create_socket(NULL, port, &sock_opts)) < 0) {
+			fprintf(stderr, "Unable to bind to port %s\n", port);
+			while (i-- > 0)
+				close(workers[i].sock);
+			free(workers);
+			return -1;
+		}
+	}
 
-			ptr = ptr->next;
+	if (n > 1)
+		fprintf(stdout, "Accepting connections on port %s (%u workers)\n", port, n);
+	else
+		fprintf(stdout, "Accepting connections on port %s\n", port);
+
+	/* Run workers */
+	if (start_logger(n) < 0) {
+		fprintf(stderr, "Unable to start logger\n");
+		for (i = 0; i < n; ++i)
+			close(workers[i].sock);
+		free(workers);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 1; i < n; ++i) {
+		if (pthread_create(&workers[i].thread, NULL, (void* (*)(void*)) engine, &workers[i]) != 0) {
+			// don't let the kernel hand connections to a socket nobody serves
+			perror("pthread_create");
+			close(workers[i].sock);
+			workers[i].sock = -1;
 		}
 	}
+	engine(&workers[0]);
+
+	for (i = 1; i < n; ++i)
+		if (workers[i].sock >= 0)
+			pthread_join(workers[i].thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stop_logger();
+
+	/* Merge counters */
+	hist_init(&delays);
+	for (i = 0; i < n; ++i) {
+		if (workers[i].sock < 0)
+			continue;
+
+		if (n > 1)
+			fprintf(stdout, "Worker %u received %" PRIu64 " bytes from %u connections (%" PRIu64 " system calls)\n",
+					i, workers[i].bytes, workers[i].conns, workers[i].calls);
+
+		bytes += workers[i].bytes;
+		calls += workers[i].calls;
+		hist_merge(&delays, &workers[i].delays);
+		early += workers[i].early;
+		setup_sum += workers[i].setup_sum;
+		setups += workers[i].setups;
+		setup_max = workers[i].setup_max > setup_max ? workers[i].setup_max : setup_max;
+		conns += workers[i].conns;
+		close(workers[i].sock);
+	}
 
-	/* Free resources */
-	free(buf);
-	for (ptr = list; ptr != NULL; ptr = ptr->next) {
-		close(ptr->sock);
-		FD_CLR(ptr->sock, &socks);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stdout, "Received %" PRIu64 " bytes from %u connections in %.2lf seconds (%.2lf Mbit/s)\n",
+			bytes, conns, secs, secs > 0 ? bytes * 8 / secs / 1e6 : 0.0);
+	fprintf(stdout, "Made %" PRIu64 " system calls in the receive path (%.1lf bytes per call)\n",
+			calls, calls > 0 ? (double) bytes / calls : 0.0);
+	if (setups > 0)
+		fprintf(stdout, "Connection setup time (SYN to first byte): avg %.3lf ms, max %.3lf ms\n",
+				setup_sum / 1e6 / setups, setup_max / 1e6);
+
+	if (delays.count > 0) {
+		fprintf(stdout, "Frame delay: %" PRIu64 " frames, p50 %.3lf ms, p99 %.3lf ms, p99.9 %.3lf ms, max %.3lf ms\n",
+				delays.count, hist_percentile(&delays, 50.0) / 1e6, hist_percentile(&delays, 99.0) / 1e6,
+				hist_percentile(&delays, 99.9) / 1e6, delays.max / 1e6);
+		if (early > 0)
+			fprintf(stdout, "%" PRIu64 " frames were timestamped after they arrived, are the clocks synchronised?\n", early);
 	}
-	free(list);
-	FD_ZERO(&socks);
+
+	free(workers);
+	return 0;
 }
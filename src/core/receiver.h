@@ -0,0 +1,177 @@
+#ifndef __RECEIVER__
+#define __RECEIVER__
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdint.h>
+#include "instance.h"
+#include "utils.h"
+
+
+
+/* How long a receiver engine should block before checking the run condition (ms) */
+#define POLL_TIMEOUT 100
+
+
+
+/* Receiver worker
+ *
+ * Every worker owns a listening socket and runs one of the receive engines
+ * below on it until the run condition is set to zero.
+ */
+struct worker {
+	pthread_t thread;        // worker thread
+	unsigned  id;            // worker number (also its log source)
+	int       sock;          // listening socket
+	int      *run;           // run condition
+	size_t    rdsz;          // number of bytes to read per call
+	unsigned  capacity;      // maximum number of concurrent connections
+	int       discard;       // drain without copying payload (MSG_TRUNC)
+	int       framed;        // parse frame headers and measure one-way delay
+	uint64_t  bytes;         // number of bytes received by the worker
+	uint64_t  calls;         // number of system calls made in the receive path
+	unsigned  conns;         // number of connections accepted by the worker
+	uint64_t  setup_sum;     // sum of connection setup times, SYN to first byte (ns)
+	uint64_t  setup_max;     // longest connection setup time (ns)
+	unsigned  setups;        // number of connections that have received data
+	hist_t    delays;        // one-way frame delays of closed connections (ns)
+	uint64_t  early;         // frames timestamped later than they arrived
+};
+
+
+
+/* Connection descriptor */
+struct conn {
+	struct sockaddr_in addr; // address of the remote side of the connection
+	char name[INET_ADDRSTRLEN]; // name of the remote side, resolved when accepted
+	int                sock; // conn socket descriptor (-1 if the slot is free)
+	unsigned           slot; // index of the connection in the table
+	uint64_t           syn;  // estimated time the SYN arrived (CLOCK_MONOTONIC, ns)
+};
+
+
+
+/* Frame reassembly state of a connection
+ *
+ * Frame headers may be split across reads, so the header is assembled in
+ * hdr until complete. The delay of a frame is recorded when its last
+ * payload byte has been read.
+ */
+struct framer {
+	unsigned char hdr[sizeof(frame_t)]; // partially received frame header
+	unsigned      have;     // number of header bytes received
+	uint32_t      left;     // payload bytes left of the current frame
+	uint64_t      ts;       // send time of the current frame (ns)
+	uint64_t      early;    // frames timestamped later than they arrived
+	int           broken;   // stream isn't framed, stop parsing
+};
+
+
+
+/* Connection table
+ *
+ * A pool of connection descriptors preallocated up front, with a stack of
+ * free slots, so that inserting and removing connections is O(1) and never
+ * allocates memory. Engines refer to connections by slot number (e.g. as
+ * epoll or io_uring user data). The byte counters are kept in a separate
+ * dense array indexed by slot.
+ */
+struct table {
+	struct conn *conns;      // connection slots
+	uint64_t    *rcvd;       // number of bytes received per slot
+	unsigned    *free;       // stack of free slots
+	unsigned     nfree;      // number of free slots
+	unsigned     capacity;   // total number of slots
+	struct framer *framers;  // frame reassembly state per slot (framing mode only)
+	hist_t      *hists;      // one-way frame delays per slot (framing mode only)
+};
+
+
+
+/* Allocate a connection table with room for capacity connections
+ *
+ * If framed is set, frame reassembly state and a delay histogram is also
+ * allocated for every slot.
+ *
+ * Returns 0 on success, or a negative value on failure.
+ */
+int create_table(struct table *table, unsigned capacity, int framed);
+
+
+
+/* Take a free slot for the connection with socket descriptor sock
+ *
+ * Returns the connection descriptor, or NULL if the table is full.
+ */
+struct conn* insert_conn(struct table *table, int sock);
+
+
+
+/* Put the slot of a connection back on the free stack
+ *
+ * The socket descriptor is not closed.
+ */
+void remove_conn(struct table *table, struct conn *conn);
+
+
+
+/* Close remaining connections and free the table */
+void destroy_table(struct table *table);
+
+
+
+/* Estimate when the SYN of a newly accepted connection arrived
+ *
+ * Uses TCP_INFO to find how long the connection waited in the accept queue
+ * after the handshake completed, and the handshake round-trip time.
+ */
+void stamp_syn(struct conn *conn);
+
+
+
+/* Record the connection setup time (SYN to first byte) of a connection
+ * that just received its first bytes.
+ */
+void stamp_first_byte(struct worker *w, struct conn *conn);
+
+
+
+/* Close a connection
+ *
+ * Log the close event (and the frame delays in framing mode), close the
+ * socket and put the connection slot back in the table.
+ */
+void close_conn(struct worker *w, struct table *table, struct conn *conn);
+
+
+
+/* Parse frames from received data
+ *
+ * Feed len bytes received at time now (FRAME_CLOCK, ns) through the frame
+ * reassembly state, recording the one-way delay of every completed frame
+ * in hist.
+ */
+void parse_frames(struct framer *framer, hist_t *hist, char const *buf, size_t len, uint64_t now);
+
+
+
+/* Current time of FRAME_CLOCK in nanoseconds */
+uint64_t frame_clock(void);
+
+
+
+/* Receive engine using edge-triggered epoll and read() */
+void* epoll_worker(struct worker *w);
+
+
+
+/* Receive engine using io_uring with multishot accept and multishot recv
+ * into a ring of provided buffers.
+ *
+ * Falls back to epoll_worker() if io_uring isn't available.
+ */
+void* uring_worker(struct worker *w);
+
+#endif
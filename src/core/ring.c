@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ring.h"
+
+
+
+/* Ring state, see ring.h */
+struct ring {
+	/* Producer side */
+	size_t tail __attribute__((aligned(CACHE_LINE))); // next slot to write
+	size_t head_cache;                                // producer's view of head
+
+	/* Consumer side */
+	size_t head __attribute__((aligned(CACHE_LINE))); // next slot to read
+	size_t tail_cache;                                // consumer's view of tail
+
+	/* Read-only after creation */
+	size_t mask __attribute__((aligned(CACHE_LINE))); // number of slots - 1
+	size_t size;                                      // record size
+	char  *data;                                      // record slots
+};
+
+
+
+/* Create a ring */
+struct ring* ring_create(size_t count, size_t size)
+{
+	struct ring *ring;
+	size_t n = 1;
+
+	while (n < count)
+		n <<= 1;
+
+	if (posix_memalign((void**) &ring, CACHE_LINE, sizeof(struct ring)) != 0)
+		return NULL;
+	memset(ring, 0, sizeof(struct ring));
+
+	if (posix_memalign((void**) &ring->data, CACHE_LINE, n * size) != 0) {
+		free(ring);
+		return NULL;
+	}
+
+	ring->mask = n - 1;
+	ring->size = size;
+	return ring;
+}
+
+
+
+/* Add a record to the ring */
+int ring_push(struct ring *ring, void const *record)
+{
+	size_t tail = ring->tail;
+
+	if (tail - ring->head_cache > ring->mask) {
+		ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (tail - ring->head_cache > ring->mask)
+			return -1;
+	}
+
+	memcpy(ring->data + (tail & ring->mask) * ring->size, record, ring->size);
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+
+/* Remove a record from the ring */
+int ring_pop(struct ring *ring, void *record)
+{
+	size_t head = ring->head;
+
+	if (head == ring->tail_cache) {
+		ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (head == ring->tail_cache)
+			return 0;
+	}
+
+	memcpy(record, ring->data + (head & ring->mask) * ring->size, ring->size);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+
+
+/* Free the ring */
+void ring_destroy(struct ring *ring)
+{
+	if (ring != NULL) {
+		free(ring->data);
+		free(ring);
+	}
+}
@@ -0,0 +1,54 @@
+#ifndef __RING__
+#define __RING__
+
+#include <stddef.h>
+
+
+/* Assumed size of a cache line */
+#define CACHE_LINE 64
+
+
+
+/* Single-producer/single-consumer ring of fixed-size records
+ *
+ * The ring is lock-free: exactly one thread may call ring_push() and exactly
+ * one (other) thread may call ring_pop() on the same ring. The producer and
+ * consumer indices are kept on separate cache lines, and each side keeps a
+ * private copy of the other side's index so that the shared line is only
+ * read when the ring looks full (or empty).
+ */
+struct ring;
+
+
+
+/* Create a ring
+ *
+ * Create a ring holding at least count records of size bytes each. The
+ * count is rounded up to the nearest power of two.
+ *
+ * Returns the ring on success, or NULL on failure.
+ */
+struct ring* ring_create(size_t count, size_t size);
+
+
+
+/* Add a record to the ring (producer side)
+ *
+ * Returns 0 on success, or -1 if the ring is full.
+ */
+int ring_push(struct ring* ring, void const* record);
+
+
+
+/* Remove a record from the ring (consumer side)
+ *
+ * Returns 1 and loads record on success, or 0 if the ring is empty.
+ */
+int ring_pop(struct ring* ring, void* record);
+
+
+
+/* Free the ring */
+void ring_destroy(struct ring* ring);
+
+#endif
@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "utils.h"
+
+
+
+/* Extend a 32-bit sequence number to 64 bits, as close as possible to ref */
+static uint64_t extend(uint64_t ref, uint32_t seq)
+{
+	return ref + (int32_t) (seq - (uint32_t) ref);
+}
+
+
+
+/* Start an RTT tracker */
+int rtt_init(rtt_t *rtt, size_t size)
+{
+	size_t n = 1;
+
+	memset(rtt, 0, sizeof(rtt_t));
+
+	while (n < size)
+		n <<= 1;
+
+	if ((rtt->segs = malloc(sizeof(rttseg_t) * n)) == NULL)
+		return -1;
+
+	rtt->size = n;
+	return 0;
+}
+
+
+
+/* Record a sent segment */
+int rtt_sent(rtt_t *rtt, uint32_t seq, uint32_t len, uint64_t ts)
+{
+	rttseg_t *seg;
+	uint64_t start, end;
+	size_t i;
+	int retransmitted;
+
+	if (len == 0)
+		return 0;
+
+	// start well clear of zero, so that earlier sequence numbers don't wrap
+	if (!rtt->started) {
+		rtt->snd_una = rtt->snd_max = (1ULL << 32) + seq;
+		rtt->started = 1;
+	}
+
+	start = extend(rtt->snd_max, seq);
+	end = start + len;
+
+	// data that has been acknowledged already
+	if (end <= rtt->snd_una)
+		return 1;
+
+	/* Retransmission: no segment it overlaps can be timed any more */
+	retransmitted = start < rtt->snd_max;
+	if (retransmitted) {
+		for (i = rtt->head; i != rtt->tail; ++i) {
+			seg = &rtt->segs[i & (rtt->size - 1)];
+			if (seg->end - seg->len >= end)
+				break;
+			if (seg->end > start)
+				seg->retransmitted = 1;
+		}
+
+		if (end <= rtt->snd_max)
+			return 1;
+	}
+
+	/* New data, or the new part of a retransmission (which can't be timed either) */
+	if (rtt->tail - rtt->head == rtt->size) {
+		++rtt->untimed;
+	} else {
+		seg = &rtt->segs[rtt->tail++ & (rtt->size - 1)];
+		seg->end = end;
+		seg->len = end - (retransmitted ? rtt->snd_max : start);
+		seg->ts = ts;
+		seg->retransmitted = retransmitted;
+	}
+
+	rtt->snd_max = end;
+	return retransmitted;
+}
+
+
+
+/* Record an acknowledgement */
+size_t rtt_acked(rtt_t *rtt, uint32_t ack, uint64_t ts, uint64_t *samples, size_t n)
+{
+	rttseg_t *seg;
+	uint64_t una;
+	size_t count = 0;
+	int ambiguous = 0;
+
+	if (!rtt->started)
+		return 0;
+
+	// like TCP, ignore acknowledgements of data that hasn't been sent
+	una = extend(rtt->snd_max, ack);
+	if (una <= rtt->snd_una || una > rtt->snd_max)
+		return 0;
+	rtt->snd_una = una;
+
+	/* Sample every segment acknowledged in full */
+	while (rtt->head != rtt->tail) {
+		seg = &rtt->segs[rtt->head & (rtt->size - 1)];
+		if (seg->end > una)
+			break;
+		++rtt->head;
+
+		if (seg->retransmitted || ts < seg->ts) {
+			++rtt->karn;
+			ambiguous = 1;
+		} else if (count < n) {
+			samples[count++] = ts - seg->ts;
+		}
+	}
+
+	// an acknowledgement released by a retransmission includes the recovery time
+	if (ambiguous) {
+		rtt->karn += count;
+		count = 0;
+	}
+
+	rtt->samples += count;
+	return count;
+}
+
+
+
+/* Free the RTT tracker */
+void rtt_free(rtt_t *rtt)
+{
+	free(rtt->segs);
+	memset(rtt, 0, sizeof(rtt_t));
+}
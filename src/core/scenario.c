@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include "scenario.h"
+
+
+/* Characters separating the fields of a scenario line */
+#define DELIM " \t\r\n"
+
+/* Argument giving the socket option profile of a group */
+#define SOCKOPT_ARG "--sockopt="
+
+
+
+/* Parse a number field */
+static int parse_number(char const *str, unsigned *value)
+{
+	char *end = NULL;
+
+	if (str == NULL)
+		return -1;
+
+	*value = strtoul(str, &end, 10);
+	return end != NULL && *end == '\0' ? 0 : -1;
+}
+
+
+
+/* Parse a scenario line into a group */
+static int parse_group(char *line, struct group *group)
+{
+	char *tok, *save = NULL, **tmp;
+
+	memset(group, 0, sizeof(struct group));
+
+	if ((tok = strtok_r(line, DELIM, &save)) == NULL || (group->streamer = strdup(tok)) == NULL)
+		return -1;
+
+	if (parse_number(strtok_r(NULL, DELIM, &save), &group->count) < 0 || group->count == 0)
+		return -1;
+
+	if (parse_number(strtok_r(NULL, DELIM, &save), &group->start) < 0)
+		return -1;
+
+	if (parse_number(strtok_r(NULL, DELIM, &save), &group->dur) < 0)
+		return -1;
+	group->dur *= 1000;
+
+	// the remaining fields are streamer arguments, argv[0] is reserved for getopt
+	if ((group->argv = malloc(sizeof(char*))) == NULL)
+		return -1;
+	group->argv[group->argc++] = group->streamer;
+
+	while ((tok = strtok_r(NULL, DELIM, &save)) != NULL) {
+
+		// the socket option profile is for the core, not the streamer
+		if (strncmp(tok, SOCKOPT_ARG, strlen(SOCKOPT_ARG)) == 0) {
+			free(group->sockopt);
+			if ((group->sockopt = strdup(tok + strlen(SOCKOPT_ARG))) == NULL)
+				return -1;
+			continue;
+		}
+
+		if ((tmp = realloc(group->argv, sizeof(char*) * (group->argc + 1))) == NULL)
+			return -1;
+		group->argv = tmp;
+		if ((group->argv[group->argc] = strdup(tok)) == NULL)
+			return -1;
+		++group->argc;
+	}
+
+	return 0;
+}
+
+
+
+/* Free a group */
+static void free_group(struct group *group)
+{
+	int i;
+
+	for (i = 1; i < group->argc; ++i)
+		free(group->argv[i]);
+	free(group->argv);
+	free(group->args);
+	free(group->sockopt);
+	free(group->streamer);
+}
+
+
+
+/* Read a scenario file */
+int read_scenario(char const *filename, struct group **groups)
+{
+	FILE *fp;
+	char *line = NULL, *ptr;
+	size_t len = 0;
+	unsigned n = 0, lineno = 0;
+	struct group *tmp;
+
+	*groups = NULL;
+	if ((fp = fopen(filename, "r")) == NULL)
+		return -1;
+
+	while (getline(&line, &len, fp) != -1) {
+		++lineno;
+
+		// skip blank lines and comments
+		for (ptr = line; *ptr == ' ' || *ptr == '\t'; ++ptr);
+		if (*ptr == '#' || *ptr == '\n' || *ptr == '\r' || *ptr == '\0')
+			continue;
+
+		if ((tmp = realloc(*groups, sizeof(struct group) * (n + 1))) == NULL)
+			goto error;
+		*groups = tmp;
+
+		if (parse_group(ptr, &(*groups)[n]) < 0) {
+			free_group(&(*groups)[n]);
+			fprintf(stderr, "Invalid flow group on line %u of %s\n", lineno, filename);
+			errno = EINVAL;
+			goto error;
+		}
+		++n;
+	}
+
+	free(line);
+	fclose(fp);
+	return n;
+
+error:
+	free_scenario(*groups, n);
+	*groups = NULL;
+	free(line);
+	fclose(fp);
+	return -1;
+}
+
+
+
+/* Free the groups read by read_scenario() */
+void free_scenario(struct group *groups, unsigned n)
+{
+	unsigned i;
+
+	for (i = 0; groups != NULL && i < n; ++i)
+		free_group(&groups[i]);
+	free(groups);
+}
+
+
+
+/* Parse streamer arguments of a group */
+int parse_args(struct group *group, struct option const *params)
+{
+	int i, n, opt, idx;
+
+	for (n = 0; params != NULL && params[n].name != NULL; ++n);
+
+	if ((group->args = calloc(n > 0 ? n : 1, sizeof(char*))) == NULL)
+		return -1;
+
+	if (params == NULL) {
+		if (group->argc > 1) {
+			fprintf(stderr, "Streamer %s takes no arguments\n", group->streamer);
+			return -1;
+		}
+		return 0;
+	}
+
+	// restart getopt, the arguments are not reported to stderr by getopt itself
+	optind = 0;
+	opterr = 0;
+	idx = -1;
+	while ((opt = getopt_long(group->argc, group->argv, ":", params, &idx)) != -1) {
+		if (opt == '?' || opt == ':' || idx < 0) {
+			fprintf(stderr, "Invalid argument for streamer %s: %s\n", group->streamer, group->argv[optind-1]);
+			return -1;
+		}
+
+		if (params[idx].flag == NULL)
+			group->args[idx] = optarg;
+		idx = -1;
+	}
+
+	if (optind < group->argc) {
+		fprintf(stderr, "Invalid argument for streamer %s: %s\n", group->streamer, group->argv[optind]);
+		return -1;
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (params[i].flag == NULL && params[i].val != 0 && group->args[i] == NULL) {
+			fprintf(stderr, "Missing argument for streamer %s: --%s\n", group->streamer, params[i].name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef __SCENARIO__
+#define __SCENARIO__
+
+#include <getopt.h>
+
+
+/* Flow group of a scenario */
+struct group
+{
+	char *streamer;          // streamer name
+	unsigned count;          // number of connections
+	unsigned start;          // start offset from the beginning of the run (ms)
+	unsigned dur;            // duration (ms), zero runs until the run is over
+	int argc;                // number of streamer arguments
+	char **argv;             // streamer arguments (--name=value or --flag)
+	char const **args;       // argument values in registration order, see parse_args()
+	char *sockopt;           // socket option profile (NULL to use the one given on the command line)
+};
+
+
+
+/* Read a scenario file
+ *
+ * Every line of a scenario file describes a flow group:
+ *
+ *   streamer count start duration [arguments...]
+ *
+ * where start is the offset in milliseconds and duration is in seconds (0
+ * means until the run is over). An argument --sockopt=profile sets the socket
+ * option profile of the group (see sockopt_t) and is not passed on to the
+ * streamer. Empty lines and lines starting with # are skipped.
+ *
+ * Returns the number of groups and loads groups on success, or a negative
+ * value on failure.
+ */
+int read_scenario(char const *filename, struct group **groups);
+
+
+
+/* Free the groups read by read_scenario() */
+void free_scenario(struct group *groups, unsigned n);
+
+
+
+/* Parse streamer arguments of a group
+ *
+ * Match the arguments of a group against the parameters registered by the
+ * streamer, and load args (one entry per parameter) with their values.
+ *
+ * Returns 0 on success, or a negative value on failure.
+ */
+int parse_args(struct group *group, struct option const *params);
+
+#endif
@@ -1,15 +1,141 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <endian.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
 #include "utils.h"
 #include "debug.h"
 
 
+/* Length of the longest congestion control algorithm name */
+#define CC_NAME_LEN 16
+
+
+
+/* Socket option that can be set in a profile */
+struct option_def
+{
+	char const *name;
+	int level;
+	int opt;
+};
+
+static struct option_def const option_defs[] = {
+	{ "nodelay",      IPPROTO_TCP, TCP_NODELAY        },
+	{ "cork",         IPPROTO_TCP, TCP_CORK           },
+	{ "lowat",        IPPROTO_TCP, TCP_NOTSENT_LOWAT  },
+	{ "pacing",       SOL_SOCKET,  SO_MAX_PACING_RATE },
+	{ "congestion",   IPPROTO_TCP, TCP_CONGESTION     },
+	{ "user-timeout", IPPROTO_TCP, TCP_USER_TIMEOUT   },
+	{ "priority",     SOL_SOCKET,  SO_PRIORITY        },
+	{ "sndbuf",       SOL_SOCKET,  SO_SNDBUF          },
+	{ "rcvbuf",       SOL_SOCKET,  SO_RCVBUF          },
+	{ NULL,           0,           0                  }
+};
+
+
+
+/* Named socket option profiles, see sockopt_t */
+static struct
+{
+	char const *name;
+	char const *options;
+} const profiles[] = {
+	{ "default", ""                                   }, // kernel defaults
+	{ "thin",    "nodelay=1,lowat=16384,priority=6"   }, // small latency-sensitive writes
+	{ "corked",  "cork=1"                             }, // coalesce small writes into full segments
+	{ "bulk",    "sndbuf=4194304,rcvbuf=4194304"      }, // large buffers for high bandwidth-delay products
+	{ NULL,      NULL                                 }
+};
+
+
+
+/* Apply a comma-separated list of profile names and name=value options */
+static int apply_options(int sock, char const *spec)
+{
+	char *copy, *tok, *save = NULL, *value, *end;
+	unsigned i;
+	unsigned num;
+	int status = 0;
+
+	if ((copy = strdup(spec)) == NULL)
+		return -1;
+
+	for (tok = strtok_r(copy, ",", &save); tok != NULL && status == 0; tok = strtok_r(NULL, ",", &save)) {
+
+		// a profile expands to its options, which later options may override
+		if ((value = strchr(tok, '=')) == NULL) {
+			for (i = 0; profiles[i].name != NULL && strcmp(profiles[i].name, tok) != 0; ++i);
+			if (profiles[i].name == NULL) {
+				fprintf(stderr, "Unknown socket option profile: %s\n", tok);
+				status = -1;
+			} else
+				status = apply_options(sock, profiles[i].options);
+			continue;
+		}
+		*value++ = '\0';
+
+		for (i = 0; option_defs[i].name != NULL && strcmp(option_defs[i].name, tok) != 0; ++i);
+		if (option_defs[i].name == NULL) {
+			fprintf(stderr, "Unknown socket option: %s\n", tok);
+			status = -1;
+			continue;
+		}
+
+		if (option_defs[i].opt == TCP_CONGESTION) {
+			status = setsockopt(sock, option_defs[i].level, option_defs[i].opt, value, strlen(value));
+		} else {
+			num = strtoul(value, &end, 0);
+			if (*value == '\0' || *end != '\0') {
+				fprintf(stderr, "Invalid value for socket option %s: '%s'\n", tok, value);
+				status = -1;
+				continue;
+			}
+			status = setsockopt(sock, option_defs[i].level, option_defs[i].opt, &num, sizeof(num));
+		}
+
+		if (status != 0)
+			fprintf(stderr, "Unable to set socket option %s=%s: %s\n", tok, value, strerror(errno));
+	}
+
+	free(copy);
+	return status;
+}
+
+
+
+/* Print the socket options that a profile can set */
+void print_sockopts(int sock, FILE *stream)
+{
+	char cc[CC_NAME_LEN];
+	unsigned value;
+	socklen_t len;
+	int i;
+
+	for (i = 0; option_defs[i].name != NULL; ++i) {
+		if (option_defs[i].opt == TCP_CONGESTION) {
+			len = sizeof(cc);
+			if (getsockopt(sock, option_defs[i].level, option_defs[i].opt, cc, &len) == 0)
+				fprintf(stream, "%s%s=%.*s", i > 0 ? " " : "", option_defs[i].name, (int) strnlen(cc, len), cc);
+		} else {
+			len = sizeof(value);
+			if (getsockopt(sock, option_defs[i].level, option_defs[i].opt, &value, &len) == 0)
+				fprintf(stream, "%s%s=%u", i > 0 ? " " : "", option_defs[i].name, value);
+		}
+	}
+	fprintf(stream, "\n");
+}
+
+
 
 /* Look up the hostname associated to an address */
 int lookup_name(struct sockaddr_in addr, char *hostname, int namelen)
@@ -57,7 +183,7 @@ int lookup_addr(int sock_desc, struct sockaddr_in *local, struct sockaddr_in *re
  * If hostname is NULL, try to bind to port and listen.
  * Otherwise, try to connect to hostname.
  */
-int create_socket(const char *hostname, const char *port)
+int create_socket(const char *hostname, const char *port, sockopt_t const *opts)
 {
 	int sock_desc = -1, status;
 	struct addrinfo hints, *ptr, *host;
@@ -88,6 +214,14 @@ int create_socket(const char *hostname, const char *port)
 			if (setsockopt(sock_desc, SOL_SOCKET, SO_REUSEADDR, &status, sizeof(status)) != 0)
 				dbgerr("setsockopt");
 
+			// let several listening sockets share the port
+			if (opts != NULL && opts->reuse_port
+					&& setsockopt(sock_desc, SOL_SOCKET, SO_REUSEPORT, &status, sizeof(status)) != 0) {
+				dbgerr(NULL);
+				close(sock_desc);
+				continue;
+			}
+
 			// try to bind to port
 			if (bind(sock_desc, ptr->ai_addr, ptr->ai_addrlen) != -1)
 				break;
@@ -101,7 +235,7 @@ int create_socket(const char *hostname, const char *port)
 
 		freeaddrinfo(host);
 
-		if (listen(sock_desc, 10) != 0) {
+		if (listen(sock_desc, opts != NULL && opts->backlog > 0 ? opts->backlog : DEF_BACKLOG) != 0) {
 			dbgerr(NULL);
 			return -3;
 		}
@@ -112,8 +246,17 @@ int create_socket(const char *hostname, const char *port)
 		for (ptr = host; ptr != NULL; ptr = ptr->ai_next) {
 			if ((sock_desc = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol)) == -1)
 				continue;
+
+			// buffer sizes must be set before the window scale is negotiated
+			if (opts != NULL && opts->profile != NULL && apply_options(sock_desc, opts->profile) != 0) {
+				close(sock_desc);
+				freeaddrinfo(host);
+				return -4;
+			}
+
 			if (connect(sock_desc, ptr->ai_addr, ptr->ai_addrlen) != -1)
 				break;
+			close(sock_desc);
 		}
 		
 		if (ptr == NULL) {
@@ -126,3 +269,59 @@ int create_socket(const char *hostname, const char *port)
 
 	return sock_desc;
 }
+
+
+
+/* Send a framed message */
+ssize_t send_frame(int sock_desc, void const *buf, size_t len, uint32_t seq)
+{
+	frame_t hdr;
+	struct timespec now;
+	struct iovec iov[2];
+	struct msghdr msg;
+	size_t left = sizeof(frame_t) + len;
+	ssize_t sent;
+
+	if (len > FRAME_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	/* stamp header as late as possible */
+	clock_gettime(FRAME_CLOCK, &now);
+	hdr.len = htonl(len);
+	hdr.seq = htonl(seq);
+	hdr.ts = htobe64(now.tv_sec * 1000000000ULL + now.tv_nsec);
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(frame_t);
+	iov[1].iov_base = (void*) buf;
+	iov[1].iov_len = len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	/* write until the whole frame is sent */
+	while (left > 0) {
+		if ((sent = sendmsg(sock_desc, &msg, 0)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		left -= sent;
+
+		// skip past what was written
+		while (msg.msg_iovlen > 0 && (size_t) sent >= msg.msg_iov->iov_len) {
+			sent -= msg.msg_iov->iov_len;
+			++msg.msg_iov;
+			--msg.msg_iovlen;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char*) msg.msg_iov->iov_base + sent;
+			msg.msg_iov->iov_len -= sent;
+		}
+	}
+
+	return len;
+}
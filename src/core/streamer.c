@@ -1,35 +1,51 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
 #include <dlfcn.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
+#include <unistd.h>
+#include <sched.h>
 #include <pthread.h>
 #include <errno.h>
 #include <time.h>
 #include <assert.h>
 #include "instance.h"
+#include "evloop.h"
 
 
 /* Make passing arguments to thread easier */
 struct thread_arg
 {
-	streamer_t entry_point;
-	pthread_mutex_t state_mutex;
-	pthread_cond_t stopped;
-	int connection;
-	int const *condition;
-	char const **arguments;
-	int *status;
+	pthread_t thread;
+	stream_t **streams;      // streams run by the thread
+	unsigned n;              // number of streams (always one for blocking streamers)
+	struct timespec const *epoch;
+	int wake;                // readable when a run flag changes (event loops only)
+	int stopped;
 };
 
 
 
-/* Hold the execution state of the streamer thread */
-static enum { RUNNING, STOPPED } streamer_state;
+/* Protects the number of running streamer threads */
+static pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Signalled when a streamer thread returns */
+static pthread_cond_t state_changed = PTHREAD_COND_INITIALIZER;
+
+/* Number of streamer threads that haven't returned yet */
+static unsigned running;
 
 
 
 
 /* Load dynamic library file / shared object file and symbols */
-int load_streamer(void **handle, char const *name, streamer_t *entry, callback_t *init)
+int load_streamer(void **handle, char const *name, streamer_t *entry, events_t const **events, callback_t *init)
 {
 	char *filename = NULL;
 	*handle = NULL;
@@ -49,9 +65,10 @@ int load_streamer(void **handle, char const *name, streamer_t *entry, callback_t
 	}
 	free(filename);
 
-	/* Load symbol for entry point */
+	/* Load symbols for entry point and event callbacks */
 	*(void**) entry = dlsym(*handle, DEF_2_STR(STREAMER_ENTRY));
-	if (*entry == NULL)
+	*(void**) events = dlsym(*handle, DEF_2_STR(STREAMER_EVENTS));
+	if (*entry == NULL && *events == NULL)
 		return -2;
 
 	/* Load symbols for initialization function */
@@ -73,103 +90,344 @@ void unload_streamer(void *handle)
 
 
 
+/* Move a point in time ms milliseconds ahead */
+static void add_ms(struct timespec *ts, unsigned ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000L * 1000L;
+	if (ts->tv_nsec >= 1000L * 1000L * 1000L) {
+		ts->tv_sec += 1;
+		ts->tv_nsec -= 1000L * 1000L * 1000L;
+	}
+}
+
+
+
+/* Is a earlier than b? */
+static int before(struct timespec const *a, struct timespec const *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+
+
+/* Notify the controller that a thread is done */
+static void thread_done(struct thread_arg *arg)
+{
+	pthread_mutex_lock(&state_mutex);
+	arg->stopped = 1;
+	--running;
+	pthread_cond_signal(&state_changed);
+	pthread_mutex_unlock(&state_mutex);
+}
+
+
+
+/* Tell event loops that run flags have changed */
+static void wake_loops(struct thread_arg const *args, unsigned n)
+{
+	uint64_t one = 1;
+	unsigned i;
+
+	for (i = 0; i < n; ++i)
+		if (args[i].wake >= 0 && write(args[i].wake, &one, sizeof(one)) != sizeof(one))
+			perror("write");
+}
+
+
+
 /* Run streamer thread */
 static void* run_streamer(struct thread_arg *arg)
 {
+	stream_t *stream = arg->streams[0];
+	struct timespec deadline, step;
 	int status;
 	
 	/* Set the thread to be cancelable */
 	assert(!pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &status));
 	assert(!pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &status));
 
+	/* Wait for the start offset, in steps so that we can stop in time */
+	deadline = step = *arg->epoch;
+	add_ms(&deadline, stream->start);
+	while (stream->run && before(&step, &deadline)) {
+		add_ms(&step, 100);
+		if (before(&deadline, &step))
+			step = deadline;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &step, NULL);
+	}
+
 	/* Call streamer entry point */
-	status = arg->entry_point(arg->connection, arg->condition, arg->arguments);
-	*(arg->status) = status;
+	if (stream->run) {
+		stream->state = STREAM_RUNNING;
+		stream->status = stream->entry(stream->conn, &stream->run, stream->args);
+		stream->state = STREAM_DONE;
+	}
 
 	/* Notify that we are done */
-	pthread_mutex_lock(&arg->state_mutex);
-	streamer_state = STOPPED;
-	pthread_cond_signal(&arg->stopped);
-	pthread_mutex_unlock(&arg->state_mutex);
+	thread_done(arg);
 
 	/* Exit thread */
-	pthread_exit(&arg->status);
+	pthread_exit(NULL);
 }
 
 
 
-/* Start streamer thread */
-int streamer(streamer_t entry, unsigned dur, int conn, int *cond, char const **args)
+/* Run event loop thread */
+static void* run_events(struct thread_arg *arg)
 {
-	pthread_t thread;
+	int status;
+
+	assert(!pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &status));
+
+	event_loop(arg->streams, arg->n, arg->epoch, arg->wake);
+
+	thread_done(arg);
+	pthread_exit(NULL);
+}
+
+
+
+/* Report per-stream and aggregate results */
+static void report_streams(stream_t const *streams, unsigned n, double secs)
+{
+	struct tcp_info info;
+	socklen_t len;
+	uint64_t acked, tot_acked = 0;
+	unsigned i, retrans, tot_retrans = 0;
+
+	for (i = 0; i < n; ++i) {
+		acked = 0;
+		retrans = 0;
+
+		len = sizeof(info);
+		memset(&info, 0, sizeof(info));
+		if (getsockopt(streams[i].conn, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+			acked = info.tcpi_bytes_acked;
+			retrans = info.tcpi_total_retrans;
+		}
+		tot_acked += acked;
+		tot_retrans += retrans;
+
+		fprintf(stdout, "Stream %u", i);
+		if (streams[i].name != NULL)
+			fprintf(stdout, " (%s)", streams[i].name);
+
+		if (streams[i].state == STREAM_WAITING)
+			fprintf(stdout, " was stopped before it started\n");
+		else if (streams[i].state == STREAM_RUNNING)
+			fprintf(stdout, " was cancelled: %" PRIu64 " bytes acked, %u retransmissions, rtt %.3lf ms\n",
+					acked, retrans, info.tcpi_rtt / 1000.0);
+		else
+			fprintf(stdout, " exited with status code %d: %" PRIu64 " bytes acked, %u retransmissions, rtt %.3lf ms\n",
+					streams[i].status, acked, retrans, info.tcpi_rtt / 1000.0);
+	}
+
+	if (n > 1)
+		fprintf(stdout, "All %u streams: %" PRIu64 " bytes acked in %.2lf seconds (%.2lf Mbit/s), %u retransmissions\n",
+				n, tot_acked, secs, secs > 0 ? tot_acked * 8 / secs / 1e6 : 0.0, tot_retrans);
+}
+
+
+
+/* Find the n-th core in a set */
+static int nth_cpu(cpu_set_t const *set, unsigned n)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		if (CPU_ISSET(cpu, set) && n-- == 0)
+			return cpu;
+
+	return -1;
+}
+
+
+
+/* Start streamer threads */
+int streamer(stream_t *streams, unsigned n, unsigned dur, int *cond)
+{
+	struct thread_arg *th_args;
+	stream_t **order;
 	pthread_attr_t attr;
-	struct thread_arg *th_arg;
-	struct timespec timeout = {0, 100 * 1000 * 1000};
-	unsigned utime = dur * 1000;
-	int status = -1;
+	cpu_set_t cpus, allowed;
+	struct timespec timeout, tick, deadline, now, start, end;
+	unsigned i, j, k, m, e, threads, loops, evented = 0, elapsed, next_stop;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int changed, pin, status = 0;
+
+	/* Only use the cores the process may run on (e.g. under taskset or a
+	 * cpuset), and don't pin threads at all if they can't be found
+	 */
+	pin = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+	if (pin)
+		ncpus = CPU_COUNT(&allowed);
+
+	/* Blocking streams get a thread each, event-driven streams share one
+	 * event loop per core
+	 */
+	for (i = 0; i < n; ++i)
+		evented += streams[i].events != NULL;
+	loops = evented < (unsigned) ncpus ? evented : (unsigned) ncpus;
+	threads = n - evented + loops;
 
 	/* Initialize thread arguments */
-	if ((th_arg = malloc(sizeof(struct thread_arg))) == NULL)
+	th_args = calloc(threads, sizeof(struct thread_arg));
+	order = calloc(n, sizeof(stream_t*));
+	if (th_args == NULL || order == NULL) {
+		free(th_args);
+		free(order);
 		return -1;
+	}
 
-	th_arg->entry_point = entry;
-	th_arg->connection = conn;
-	th_arg->condition = cond;
-	th_arg->arguments = args;
-	th_arg->status = &status;
+	for (i = 0, j = 0; i < n; ++i) {
+		streams[i].status = -1;
+		streams[i].state = STREAM_WAITING;
+		streams[i].run = 1;
+		if (streams[i].events == NULL) {
+			order[j] = &streams[i];
+			th_args[j].streams = &order[j];
+			th_args[j].n = 1;
+			th_args[j].wake = -1;
+			++j;
+		}
+	}
 
-	assert(!pthread_mutex_init(&th_arg->state_mutex, NULL));
-	assert(!pthread_cond_init(&th_arg->stopped, NULL));
+	// split the event-driven streams evenly between the loops
+	for (k = 0, m = j; k < loops; ++k, ++j) {
+		if ((th_args[j].wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+			perror("eventfd");
+			while (k-- > 0)
+				close(th_args[--j].wake);
+			free(th_args);
+			free(order);
+			return -1;
+		}
+		th_args[j].streams = &order[m];
+		for (i = 0, e = 0; i < n; ++i) {
+			if (streams[i].events != NULL && e++ % loops == k) {
+				order[m++] = &streams[i];
+				++th_args[j].n;
+			}
+		}
+	}
 
-	/* Set thread to be joinable */
+	/* Set threads to be joinable */
 	assert(!pthread_attr_init(&attr));
 	assert(!pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE));
 
-	/* Start thread */
-	streamer_state = RUNNING;
-	assert(!pthread_create(&thread, NULL, (void* (*)(void*)) &run_streamer, th_arg));
+	/* Start threads, spread across the available cores */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	running = 0;
+	for (i = 0; i < threads; ++i) {
+		th_args[i].epoch = &start;
+
+		if (pin && threads > 1 && ncpus > 1) {
+			CPU_ZERO(&cpus);
+			CPU_SET(nth_cpu(&allowed, i % ncpus), &cpus);
+			if (pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus) != 0) {
+				// run this and the remaining threads anywhere they are allowed to
+				pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &allowed);
+				pin = 0;
+			}
+		}
+
+		pthread_mutex_lock(&state_mutex);
+		++running;
+		pthread_mutex_unlock(&state_mutex);
+
+		if (pthread_create(&th_args[i].thread, &attr,
+					(void* (*)(void*)) (th_args[i].streams[0]->events != NULL ? &run_events : &run_streamer), &th_args[i]) != 0) {
+			perror("pthread_create");
+			pthread_mutex_lock(&state_mutex);
+			--running;
+			pthread_mutex_unlock(&state_mutex);
+			*cond = 0;
+			for (j = i; j < threads; ++j)
+				if (th_args[j].wake >= 0)
+					close(th_args[j].wake);
+			threads = i;
+			break;
+		}
+	}
 
 
-	/* Count down duration down */
+	/* Check on the streams at fixed deadlines until the duration has passed,
+	 * and stop every stream that has run for its own duration
+	 */
+	tick = start;
 	while (*cond) {
 		
-		if (pthread_mutex_trylock(&th_arg->state_mutex) == 0) {
-			if (streamer_state != RUNNING)
-				*cond = 0;
-			pthread_mutex_unlock(&th_arg->state_mutex);
+		pthread_mutex_lock(&state_mutex);
+		if (running == 0)
+			*cond = 0;
+		pthread_mutex_unlock(&state_mutex);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / (1000 * 1000);
+		if (dur != 0 && elapsed >= dur * 1000)
+			*cond = 0;
+
+		changed = 0;
+		next_stop = 0;
+		for (i = 0; i < n; ++i) {
+			if (streams[i].run && streams[i].stop != 0 && streams[i].stop <= elapsed) {
+				streams[i].run = 0;
+				changed = 1;
+			} else if (streams[i].run && streams[i].stop != 0 && (next_stop == 0 || streams[i].stop < next_stop))
+				next_stop = streams[i].stop;
 		}
-
-		if (dur != 0) {
-			if (utime == 0)
-				*cond = 0;
-			else {
-				nanosleep(&timeout, NULL);
-				utime -= 100;
-			}
+		if (changed)
+			wake_loops(th_args, threads);
+
+		if (*cond) {
+			while (!before(&now, &tick))
+				add_ms(&tick, 100);
+			deadline = start;
+			add_ms(&deadline, next_stop);
+			if (next_stop == 0 || before(&tick, &deadline))
+				deadline = tick;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
 		}
 	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	// stop all streams
+	for (i = 0; i < n; ++i)
+		streams[i].run = 0;
+	wake_loops(th_args, threads);
 
 
-	/* Wait for streamer thread to complete */
-	pthread_mutex_lock(&th_arg->state_mutex);
-	if (streamer_state == RUNNING) {
+	/* Wait for streamer threads to complete */
+	pthread_mutex_lock(&state_mutex);
+	if (running > 0) {
 
 		assert(clock_gettime(CLOCK_REALTIME, &timeout) == 0);
-		timeout.tv_nsec += 500 << 20; // ~.5 seconds
+		add_ms(&timeout, 500);
 
-		if (pthread_cond_timedwait(&th_arg->stopped, &th_arg->state_mutex, &timeout) == ETIMEDOUT) {
-			pthread_cancel(thread);
-		}
+		while (running > 0 && pthread_cond_timedwait(&state_changed, &state_mutex, &timeout) != ETIMEDOUT);
+
+		for (i = 0; i < threads; ++i)
+			if (!th_args[i].stopped)
+				pthread_cancel(th_args[i].thread);
 	}
-	pthread_mutex_unlock(&th_arg->state_mutex);
+	pthread_mutex_unlock(&state_mutex);
 
 
 	/* Streamer thread rendezvous and resource freeing */
-	pthread_join(thread, (void**) &th_arg->status);
+	for (i = 0; i < threads; ++i)
+		pthread_join(th_args[i].thread, NULL);
 	pthread_attr_destroy(&attr);
-	pthread_cond_destroy(&th_arg->stopped);
-	pthread_mutex_destroy(&th_arg->state_mutex);
-	free(th_arg);
+	for (i = 0; i < threads; ++i)
+		if (th_args[i].wake >= 0)
+			close(th_args[i].wake);
+
+	report_streams(streams, n, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+	for (i = 0; i < n && status == 0; ++i)
+		status = streams[i].status;
 
+	free(order);
+	free(th_args);
 	return status;
 }
@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include "utils.h"
+
+
+
+/* Current time in nanoseconds (PACE_CLOCK) */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(PACE_CLOCK, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+
+/* Start a sampler */
+int sampler_init(sampler_t *sampler, int sock, size_t size, uint64_t interval)
+{
+	memset(sampler, 0, sizeof(sampler_t));
+
+	if (size == 0 || (sampler->samples = malloc(sizeof(tcpinfo_t) * size)) == NULL)
+		return -1;
+
+	sampler->sock = sock;
+	sampler->size = size;
+	sampler->interval = interval;
+	sampler->start = now_ns();
+	return 0;
+}
+
+
+
+/* Take a sample if it is time */
+int sampler_poll(sampler_t *sampler)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	tcpinfo_t *sample;
+	uint64_t now = now_ns() - sampler->start;
+
+	if (now < sampler->next)
+		return 0;
+
+	memset(&info, 0, sizeof(info));
+	if (getsockopt(sampler->sock, IPPROTO_TCP, TCP_INFO, &info, &len) != 0)
+		return -1;
+
+	// fields the kernel doesn't know about are left zero
+	sample = &sampler->samples[sampler->count++ % sampler->size];
+	sample->ts = now;
+	sample->srtt = info.tcpi_rtt;
+	sample->rttvar = info.tcpi_rttvar;
+	sample->cwnd = info.tcpi_snd_cwnd;
+	sample->ssthresh = info.tcpi_snd_ssthresh;
+	sample->retrans = info.tcpi_total_retrans;
+	sample->unacked = info.tcpi_unacked;
+	sample->lost = info.tcpi_lost;
+	sample->delivery_rate = info.tcpi_delivery_rate;
+
+	sampler->next = now + sampler->interval;
+	return 1;
+}
+
+
+
+/* Dump the samples */
+void sampler_dump(sampler_t const *sampler, FILE *stream)
+{
+	tcpinfo_t const *s;
+	uint64_t i = sampler->count > sampler->size ? sampler->count - sampler->size : 0;
+
+	if (sampler->count > sampler->size)
+		fprintf(stream, "# %" PRIu64 " oldest samples were overwritten\n", i);
+
+	fprintf(stream, "# time(s)\tsrtt(us)\trttvar(us)\tcwnd\tssthresh\tretrans\tunacked\tlost\tdelivery(bytes/s)\n");
+	for (; i < sampler->count; ++i) {
+		s = &sampler->samples[i % sampler->size];
+		fprintf(stream, "%.6lf\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%" PRIu64 "\n",
+				s->ts / 1e9, s->srtt, s->rttvar, s->cwnd, s->ssthresh,
+				s->retrans, s->unacked, s->lost, s->delivery_rate);
+	}
+}
+
+
+
+/* Free the sample ring */
+void sampler_free(sampler_t *sampler)
+{
+	free(sampler->samples);
+	sampler->samples = NULL;
+	sampler->count = 0;
+}
@@ -0,0 +1,93 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "utils.h"
+
+
+
+/* Convert a timespec to nanoseconds */
+static uint64_t to_ns(struct timespec const *ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+
+
+/* Convert nanoseconds to a timespec */
+static void from_ns(struct timespec *ts, uint64_t ns)
+{
+	ts->tv_sec = ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+
+
+/* Start a pacer */
+void pacer_init(pacer_t *pacer, uint64_t interval, uint64_t spin)
+{
+	struct timespec now;
+
+	memset(pacer, 0, sizeof(pacer_t));
+	hist_init(&pacer->error);
+	pacer->interval = interval;
+	pacer->spin = interval > 0 && spin > interval ? interval : spin;
+
+	clock_gettime(PACE_CLOCK, &now);
+	pacer->start = now;
+	from_ns(&pacer->next, to_ns(&now) + interval);
+}
+
+
+
+/* Sleep until a deadline and record how late we woke up */
+static int64_t sleep_until(pacer_t *pacer, uint64_t deadline)
+{
+	struct timespec wake, now;
+	uint64_t late;
+	int status;
+
+	// sleep until the deadline (or until it is time to spin)
+	from_ns(&wake, deadline > pacer->spin ? deadline - pacer->spin : 0);
+	while ((status = clock_nanosleep(PACE_CLOCK, TIMER_ABSTIME, &wake, NULL)) == EINTR);
+	if (status != 0)
+		return -1;
+
+	do
+		clock_gettime(PACE_CLOCK, &now);
+	while (to_ns(&now) < deadline);
+
+	late = to_ns(&now) - deadline;
+	hist_add(&pacer->error, late);
+	return late;
+}
+
+
+
+/* Wait for the next deadline */
+int pacer_wait(pacer_t *pacer)
+{
+	uint64_t deadline = to_ns(&pacer->next);
+	int64_t late;
+	int skipped = 0;
+
+	if ((late = sleep_until(pacer, deadline)) < 0)
+		return -1;
+
+	// skip deadlines that have passed instead of catching up
+	if ((uint64_t) late >= pacer->interval && pacer->interval > 0) {
+		skipped = late / pacer->interval;
+		pacer->missed += skipped;
+	}
+
+	from_ns(&pacer->next, deadline + (skipped + 1) * pacer->interval);
+	return skipped;
+}
+
+
+
+/* Wait until offset nanoseconds after the pacer was started */
+int pacer_wait_at(pacer_t *pacer, uint64_t offset)
+{
+	return sleep_until(pacer, to_ns(&pacer->start) + offset) < 0 ? -1 : 0;
+}
@@ -0,0 +1,222 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "capture.h"
+#include "debug.h"
+
+
+
+/* Block descriptor of block i */
+static struct tpacket_block_desc* get_block(struct capture *cap, unsigned i)
+{
+	return (struct tpacket_block_desc*) (cap->ring + (size_t) i * CAPTURE_BLOCK_SIZE);
+}
+
+
+
+/* Replace the filter of the packet socket */
+int tpacket_filter(struct capture *cap, struct bpf_program const *filter)
+{
+	struct sock_fprog prog;
+
+	prog.len = filter->bf_len;
+	prog.filter = (struct sock_filter*) filter->bf_insns;
+	if (setsockopt(cap->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1) {
+		dbgerr(NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+
+/* Set up a packet ring capture */
+int tpacket_open(struct capture *cap, char const *dev)
+{
+	struct ifreq ifr;
+	struct sock_filter reject = BPF_STMT(BPF_RET | BPF_K, 0);
+	struct sock_fprog prog = { 1, &reject };
+	struct tpacket_req3 req;
+	struct sockaddr_ll ll;
+	int version = TPACKET_V3;
+
+	// no protocol until bound, so that nothing is queued before the filter is attached
+	if ((cap->fd = socket(AF_PACKET, SOCK_RAW, 0)) == -1) {
+		dbgerr(NULL);
+		return -1;
+	}
+
+	/* Find the framing of the device, loopback devices get an all-zero Ethernet header */
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
+	if (ioctl(cap->fd, SIOCGIFHWADDR, &ifr) == -1) {
+		close(cap->fd);
+		return -2;
+	}
+
+	switch (ifr.ifr_hwaddr.sa_family) {
+		case ARPHRD_ETHER:
+		case ARPHRD_LOOPBACK:
+			cap->linktype = LINK_ETHERNET;
+			break;
+
+		case ARPHRD_NONE:
+			cap->linktype = DLT_RAW;
+			break;
+
+		default:
+			close(cap->fd);
+			return -2;
+	}
+	cap->loopback = ifr.ifr_hwaddr.sa_family == ARPHRD_LOOPBACK;
+
+	/* Reject everything until the real filter is attached */
+	if (setsockopt(cap->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1
+			|| setsockopt(cap->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1) {
+		dbgerr(NULL);
+		close(cap->fd);
+		return -3;
+	}
+
+	/* Set up the ring, a block is handed over when it is full or has waited for the timeout */
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = CAPTURE_BLOCK_SIZE;
+	req.tp_block_nr = CAPTURE_BLOCKS;
+	req.tp_frame_size = CAPTURE_FRAME_SIZE;
+	req.tp_frame_nr = CAPTURE_BLOCK_SIZE / CAPTURE_FRAME_SIZE * CAPTURE_BLOCKS;
+	req.tp_retire_blk_tov = cap->timeout;
+	if (setsockopt(cap->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1) {
+		dbgerr(NULL);
+		close(cap->fd);
+		return -3;
+	}
+
+	cap->ring = mmap(NULL, (size_t) CAPTURE_BLOCK_SIZE * CAPTURE_BLOCKS, PROT_READ | PROT_WRITE, MAP_SHARED, cap->fd, 0);
+	if (cap->ring == MAP_FAILED) {
+		dbgerr(NULL);
+		cap->ring = NULL;
+		close(cap->fd);
+		return -3;
+	}
+
+	/* Start capturing */
+	memset(&ll, 0, sizeof(ll));
+	ll.sll_family = AF_PACKET;
+	ll.sll_protocol = htons(ETH_P_ALL);
+	ll.sll_ifindex = if_nametoindex(dev);
+	if (ll.sll_ifindex == 0 || bind(cap->fd, (struct sockaddr*) &ll, sizeof(ll)) == -1) {
+		dbgerr(NULL);
+		tpacket_close(cap);
+		return -3;
+	}
+
+	cap->block = 0;
+	cap->left = 0;
+	cap->next = NULL;
+	memset(&cap->stats, 0, sizeof(capstats_t));
+	return 0;
+}
+
+
+
+/* Fetch the next frame in the packet ring */
+int tpacket_frame(struct capture *cap, int timeout, struct captured *frame)
+{
+	struct tpacket_block_desc *block;
+	struct tpacket3_hdr *hdr;
+	struct sockaddr_ll const *ll;
+	struct pollfd pfd;
+
+	while (1) {
+
+		/* Return the exhausted block to the kernel and wait for the next */
+		if (cap->left == 0) {
+			if (cap->next != NULL) {
+				get_block(cap, cap->block)->hdr.bh1.block_status = TP_STATUS_KERNEL;
+				cap->block = (cap->block + 1) % CAPTURE_BLOCKS;
+				cap->next = NULL;
+			}
+
+			block = get_block(cap, cap->block);
+			if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+				if (timeout == 0)
+					return 0;
+
+				pfd.fd = cap->fd;
+				pfd.events = POLLIN | POLLERR;
+				pfd.revents = 0;
+				if (poll(&pfd, 1, timeout) == -1 && errno != EINTR) {
+					dbgerr(NULL);
+					return -1;
+				}
+
+				if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+					return 0;
+			}
+
+			// a retired block may be empty, it is still released on the next call
+			cap->left = block->hdr.bh1.num_pkts;
+			cap->next = (struct tpacket3_hdr*) ((uint8_t*) block + block->hdr.bh1.offset_to_first_pkt);
+			if (cap->left == 0)
+				continue;
+		}
+
+		hdr = cap->next;
+		if (--cap->left > 0)
+			cap->next = (struct tpacket3_hdr*) ((uint8_t*) hdr + hdr->tp_next_offset);
+
+		// loopback frames are seen both going out and coming in
+		ll = (struct sockaddr_ll const*) ((uint8_t*) hdr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+		if (cap->loopback && ll->sll_pkttype == PACKET_OUTGOING)
+			continue;
+
+		frame->data = (uint8_t const*) hdr + hdr->tp_mac;
+		frame->caplen = hdr->tp_snaplen;
+		frame->wirelen = hdr->tp_len;
+		frame->ts = hdr->tp_sec * 1000000000ULL + hdr->tp_nsec;
+		return 1;
+	}
+}
+
+
+
+/* Get packet ring statistics, the kernel counters are reset when read */
+int tpacket_stats(struct capture *cap, capstats_t *stats)
+{
+	struct tpacket_stats_v3 st;
+	socklen_t len = sizeof(st);
+
+	if (getsockopt(cap->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == -1)
+		return -1;
+
+	// the packet count includes dropped frames
+	cap->stats.packets += st.tp_packets - st.tp_drops;
+	cap->stats.drops += st.tp_drops;
+	cap->stats.freezes += st.tp_freeze_q_cnt;
+	*stats = cap->stats;
+	return 0;
+}
+
+
+
+/* Unmap the ring and close the packet socket */
+void tpacket_close(struct capture *cap)
+{
+	if (cap->ring != NULL)
+		munmap(cap->ring, (size_t) CAPTURE_BLOCK_SIZE * CAPTURE_BLOCKS);
+	cap->ring = NULL;
+	close(cap->fd);
+}
@@ -0,0 +1,418 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "utils.h"
+#include "receiver.h"
+#include "logger.h"
+
+
+/* Number of submission queue entries */
+#define URING_ENTRIES 256
+
+/* Number of provided receive buffers (must be a power of two) */
+#define URING_BUFS 256
+
+/* Buffer group identifier of the provided buffer ring */
+#define URING_BGID 0
+
+/* User data tag of the multishot accept request */
+#define ACCEPT_TAG ((uint64_t) -1)
+
+
+
+/* Ring state
+ *
+ * liburing isn't used, the rings are mapped and driven directly through the
+ * io_uring_setup(2), io_uring_enter(2) and io_uring_register(2) system calls.
+ */
+struct uring {
+	int                       fd;        // io_uring file descriptor
+	void                     *rings;     // mapped submission and completion rings
+	size_t                    rings_sz;  // size of the ring mapping
+	struct io_uring_sqe      *sqes;      // submission queue entries
+	size_t                    sqes_sz;   // size of the entry mapping
+	unsigned                 *sq_head;   // submission queue head (written by kernel)
+	unsigned                 *sq_tail;   // submission queue tail
+	unsigned                 *sq_array;  // submission queue index array
+	unsigned                  sq_mask;   // submission queue index mask
+	unsigned                  sq_size;   // number of submission queue entries
+	unsigned                  sq_local;  // local submission queue tail
+	unsigned                 *cq_head;   // completion queue head
+	unsigned                 *cq_tail;   // completion queue tail (written by kernel)
+	unsigned                  cq_mask;   // completion queue index mask
+	struct io_uring_cqe      *cqes;      // completion queue entries
+	struct io_uring_buf_ring *br;        // provided buffer ring
+	unsigned short            br_tail;   // local buffer ring tail
+	char                     *bufs;      // receive buffers
+	size_t                    bufsz;     // size of each receive buffer
+	uint64_t                 *calls;     // system call counter of the worker
+};
+
+
+
+/* Release ring resources */
+static void uring_destroy(struct uring *r)
+{
+	if (r->fd >= 0)
+		close(r->fd);
+	if (r->rings != NULL && r->rings != MAP_FAILED)
+		munmap(r->rings, r->rings_sz);
+	if (r->sqes != NULL && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_sz);
+	if (r->br != NULL && r->br != MAP_FAILED)
+		munmap(r->br, sizeof(struct io_uring_buf) * URING_BUFS);
+	free(r->bufs);
+}
+
+
+
+/* Hand a receive buffer (back) to the kernel */
+static void recycle_buffer(struct uring *r, unsigned short bid)
+{
+	struct io_uring_buf *buf = &r->br->bufs[r->br_tail & (URING_BUFS - 1)];
+
+	buf->addr = (uint64_t) (uintptr_t) (r->bufs + (size_t) bid * r->bufsz);
+	buf->len = r->bufsz;
+	buf->bid = bid;
+
+	__atomic_store_n(&r->br->tail, ++r->br_tail, __ATOMIC_RELEASE);
+}
+
+
+
+/* Set up rings and register the provided buffer ring
+ *
+ * Returns 0 on success, or a negative value on failure.
+ */
+static int uring_create(struct uring *r, size_t bufsz)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	size_t sq_sz, cq_sz;
+	unsigned i;
+
+	memset(r, 0, sizeof(struct uring));
+	memset(&p, 0, sizeof(p));
+	r->bufsz = bufsz;
+
+	/* leave room for plenty of multishot completions */
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_ENTRIES * 8;
+
+	if ((r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+		return -1;
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+		errno = ENOSYS;
+		uring_destroy(r);
+		return -1;
+	}
+
+	/* map submission and completion rings */
+	sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->rings_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+	r->rings = mmap(NULL, r->rings_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->rings == MAP_FAILED) {
+		uring_destroy(r);
+		return -2;
+	}
+
+	r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		uring_destroy(r);
+		return -2;
+	}
+
+	r->sq_head = (unsigned*) ((char*) r->rings + p.sq_off.head);
+	r->sq_tail = (unsigned*) ((char*) r->rings + p.sq_off.tail);
+	r->sq_array = (unsigned*) ((char*) r->rings + p.sq_off.array);
+	r->sq_mask = *(unsigned*) ((char*) r->rings + p.sq_off.ring_mask);
+	r->sq_size = p.sq_entries;
+	r->sq_local = *r->sq_tail;
+	r->cq_head = (unsigned*) ((char*) r->rings + p.cq_off.head);
+	r->cq_tail = (unsigned*) ((char*) r->rings + p.cq_off.tail);
+	r->cq_mask = *(unsigned*) ((char*) r->rings + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*) ((char*) r->rings + p.cq_off.cqes);
+
+	/* allocate receive buffers and register the buffer ring */
+	r->br = mmap(NULL, sizeof(struct io_uring_buf) * URING_BUFS, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (r->br == MAP_FAILED || (r->bufs = malloc(URING_BUFS * bufsz)) == NULL) {
+		uring_destroy(r);
+		return -3;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) r->br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		uring_destroy(r);
+		return -4;
+	}
+
+	for (i = 0; i < URING_BUFS; ++i)
+		recycle_buffer(r, i);
+
+	return 0;
+}
+
+
+
+/* Submit queued requests without waiting for completions
+ *
+ * Returns the number of requests submitted, or a negative value on failure.
+ */
+static int flush_sq(struct uring *r)
+{
+	unsigned pending;
+	int n;
+
+	__atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+	pending = r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+	do {
+		if (r->calls != NULL)
+			++*r->calls;
+		n = syscall(__NR_io_uring_enter, r->fd, pending, 0, 0, NULL, 0);
+	} while (n < 0 && errno == EINTR);
+
+	return n;
+}
+
+
+
+/* Get a free submission queue entry
+ *
+ * A full queue is submitted first, so a burst of requests in one pass never
+ * fails for lack of entries. Returns NULL only if submitting fails.
+ */
+static struct io_uring_sqe* get_sqe(struct uring *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	while (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_size)
+		if (flush_sq(r) <= 0)
+			return NULL;
+
+	idx = r->sq_local++ & r->sq_mask;
+	r->sq_array[idx] = idx;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+
+
+/* Queue a multishot accept on the listening socket */
+static int arm_accept(struct uring *r, int listen_sock)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = get_sqe(r)) == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listen_sock;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = ACCEPT_TAG;
+	return 0;
+}
+
+
+
+/* Queue a multishot receive into the provided buffer ring
+ *
+ * If discard is set, the data is dropped by the kernel instead of being
+ * copied into the selected buffer (MSG_TRUNC).
+ */
+static int arm_recv(struct uring *r, struct conn const *conn, int discard)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = get_sqe(r)) == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->sock;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->msg_flags = discard ? MSG_TRUNC : 0;
+	sqe->user_data = conn->slot;
+	return 0;
+}
+
+
+
+/* Submit queued requests and wait for at least one completion
+ *
+ * Returns 0 on success, 1 on timeout or interrupt, or a negative value on
+ * failure.
+ */
+static int submit_and_wait(struct uring *r)
+{
+	struct __kernel_timespec ts = { 0, POLL_TIMEOUT * 1000 * 1000 };
+	struct io_uring_getevents_arg arg;
+	unsigned pending;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (uint64_t) (uintptr_t) &ts;
+
+	__atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+	pending = r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+	if (syscall(__NR_io_uring_enter, r->fd, pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0) {
+		if (errno == ETIME || errno == EINTR || errno == EBUSY)
+			return 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+
+/* Accept connections and receive data from them using io_uring */
+void* uring_worker(struct worker *w)
+{
+	struct uring ring;
+	struct io_uring_cqe *cqe;
+	struct table table;
+	struct conn *ptr;
+	struct sockaddr_in addr;
+	char name[INET_ADDRSTRLEN];
+	unsigned i, head, tail;
+	int sock, accepting;
+
+	if (uring_create(&ring, w->rdsz) < 0) {
+		perror("io_uring");
+		fprintf(stderr, "io_uring is not available, falling back to epoll\n");
+		return epoll_worker(w);
+	}
+	ring.calls = &w->calls;
+
+	if (create_table(&table, w->capacity, w->framed) < 0) {
+		perror("create_table");
+		uring_destroy(&ring);
+		return NULL;
+	}
+
+	if (arm_accept(&ring, w->sock) < 0) {
+		uring_destroy(&ring);
+		destroy_table(&table);
+		return NULL;
+	}
+
+	accepting = 1;
+	while (*w->run) {
+
+		// the listener must never be left without an accept request
+		if (!accepting)
+			accepting = arm_accept(&ring, w->sock) == 0;
+
+		++w->calls;
+		if (submit_and_wait(&ring) < 0) {
+			perror("io_uring_enter");
+			break;
+		}
+
+		/* Reap completions */
+		head = *ring.cq_head;
+		tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			cqe = &ring.cqes[head & ring.cq_mask];
+
+			/* Accept incomming connection */
+			if (cqe->user_data == ACCEPT_TAG) {
+
+				if (!(cqe->flags & IORING_CQE_F_MORE) && arm_accept(&ring, w->sock) < 0) {
+					fprintf(stderr, "Unable to re-arm accept, retrying\n");
+					accepting = 0;
+				}
+
+				if (cqe->res < 0) {
+					errno = -cqe->res;
+					perror("accept");
+					continue;
+				}
+
+				// take a slot for the new connection
+				sock = cqe->res;
+				lookup_addr(sock, NULL, &addr);
+				if ((ptr = insert_conn(&table, sock)) == NULL) {
+					lookup_name(addr, name, sizeof(name));
+					log_event(w->id, LOG_REJECT, name, 0);
+					close(sock);
+					continue;
+				}
+				ptr->addr = addr;
+				stamp_syn(ptr);
+				lookup_name(ptr->addr, ptr->name, sizeof(ptr->name));
+
+				if (arm_recv(&ring, ptr, w->discard) < 0) {
+					perror("io_uring_enter");
+					close(sock);
+					remove_conn(&table, ptr);
+					continue;
+				}
+				++w->conns;
+
+				log_event(w->id, LOG_ACCEPT, ptr->name, 0);
+				continue;
+			}
+
+			/* Read data from the connection */
+			ptr = &table.conns[cqe->user_data];
+			if (ptr->sock < 0)
+				continue;
+
+			if (cqe->res > 0) {
+				if (table.rcvd[ptr->slot] == 0)
+					stamp_first_byte(w, ptr);
+				table.rcvd[ptr->slot] += cqe->res;
+				w->bytes += cqe->res;
+
+				if (cqe->flags & IORING_CQE_F_BUFFER) {
+					if (w->framed)
+						parse_frames(&table.framers[ptr->slot], &table.hists[ptr->slot],
+								ring.bufs + (cqe->flags >> IORING_CQE_BUFFER_SHIFT) * ring.bufsz, cqe->res, frame_clock());
+					recycle_buffer(&ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+				}
+
+				log_event(w->id, LOG_RECV, ptr->name, cqe->res);
+			}
+
+			// multishot receive has terminated
+			if (!(cqe->flags & IORING_CQE_F_MORE)) {
+
+				// out of buffers or some other transient condition, re-arm
+				if ((cqe->res > 0 || cqe->res == -ENOBUFS) && arm_recv(&ring, ptr, w->discard) == 0)
+					continue;
+
+				close_conn(w, &table, ptr);
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	/* Free resources (closing the ring cancels pending requests) */
+	uring_destroy(&ring);
+	for (i = 0; i < table.capacity; ++i)
+		if (table.conns[i].sock >= 0)
+			close_conn(w, &table, &table.conns[i]);
+
+	destroy_table(&table);
+	return NULL;
+}
@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include "utils.h"
+#include "bootstrap.h"
+
+
+/* Default size of the payload buffer (bytes) */
+#define BUF_SIZE 65536
+
+/* Default number of buffers written per call */
+#define BATCH 16
+
+/* Largest number of buffers written per call */
+#define MAX_BATCH 1024
+
+/* Time between goodput reports (ns) */
+#define REPORT_INTERVAL 1000000000ULL
+
+
+
+/* Current time in nanoseconds (PACE_CLOCK) */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(PACE_CLOCK, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+
+/* Number of bytes acknowledged by the receiver */
+static uint64_t bytes_acked(int sock)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+
+	if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) != 0)
+		return 0;
+	return info.tcpi_bytes_acked;
+}
+
+
+
+/* Set a socket option and print the value the kernel actually uses */
+static int set_option(int sock, int level, int name, char const *arg, char const *desc)
+{
+	int value = atoi(arg);
+	socklen_t len = sizeof(value);
+
+	if (value <= 0 || setsockopt(sock, level, name, &value, sizeof(value)) == -1) {
+		fprintf(stderr, "Invalid %s: '%s'\n", desc, arg);
+		return -1;
+	}
+
+	if (getsockopt(sock, level, name, &value, &len) == 0)
+		fprintf(stdout, "Using %s of %d bytes\n", desc, value);
+	return 0;
+}
+
+
+
+/* Write the buffer cnt times in one call, retrying short writes from where they left off */
+static ssize_t write_batch(int sock, char const *buf, size_t len, struct iovec *iov, int cnt)
+{
+	size_t total = len * cnt, left = total;
+	ssize_t sent;
+	int i;
+
+	for (i = 0; i < cnt; ++i) {
+		iov[i].iov_base = (void*) buf;
+		iov[i].iov_len = len;
+	}
+
+	while (left > 0) {
+		if ((sent = writev(sock, iov, cnt)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return left < total ? (ssize_t) (total - left) : -1;
+		}
+		left -= sent;
+
+		// skip the buffers that were written and trim the partial one
+		while (cnt > 0 && (size_t) sent >= iov->iov_len) {
+			sent -= iov->iov_len;
+			++iov;
+			--cnt;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char*) iov->iov_base + sent;
+			iov->iov_len -= sent;
+		}
+	}
+
+	return total;
+}
+
+
+
+/* Send as fast as the connection allows, from memory */
+int streamer(int sock, const int *run, const char **args)
+{
+	long bufsz = BUF_SIZE, batch = BATCH;
+	double rate = 0;
+	char *buf = NULL;
+	struct iovec *iov = NULL;
+	pacer_t *pacer = NULL;
+	uint64_t sent = 0, acked = 0, last_sent = 0, last_acked, start, now, last;
+	ssize_t len;
+	long i;
+	int status = 0;
+
+	/* Parse arguments */
+	if (args[0] != NULL && ((bufsz = atol(args[0])) <= 0 || bufsz > FRAME_MAX)) {
+		fprintf(stderr, "Invalid buffer size: '%s'\n", args[0]);
+		return -2;
+	}
+
+	if (args[1] != NULL && ((batch = atol(args[1])) <= 0 || batch > MAX_BATCH)) {
+		fprintf(stderr, "Invalid batch size: '%s'\n", args[1]);
+		return -2;
+	}
+
+	if (args[4] != NULL && (rate = atof(args[4])) <= 0) {
+		fprintf(stderr, "Invalid rate: '%s'\n", args[4]);
+		return -2;
+	}
+
+	if (args[2] != NULL && set_option(sock, SOL_SOCKET, SO_SNDBUF, args[2], "send buffer size") < 0)
+		return -2;
+
+	if (args[3] != NULL && set_option(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, args[3], "unsent low watermark") < 0)
+		return -2;
+
+	/* Allocate a page-aligned payload buffer with a recognisable pattern */
+	if (posix_memalign((void**) &buf, sysconf(_SC_PAGESIZE), bufsz) != 0) {
+		perror("posix_memalign");
+		return -4;
+	}
+	for (i = 0; i < bufsz; ++i)
+		buf[i] = 'a' + i % 26;
+
+	// every write sends the same buffer batch times
+	if ((iov = malloc(sizeof(struct iovec) * batch)) == NULL) {
+		perror("malloc");
+		free(buf);
+		return -4;
+	}
+
+	if (rate > 0) {
+		if ((pacer = malloc(sizeof(pacer_t))) == NULL) {
+			perror("malloc");
+			free(iov);
+			free(buf);
+			return -4;
+		}
+		pacer_init(pacer, 0, 0);
+	}
+
+	/* Run streamer */
+	start = now_ns();
+	last = start;
+	last_acked = bytes_acked(sock);
+	while (*run) {
+
+		// hold back until the bytes sent so far are due at the capped rate (Mbit/s)
+		if (pacer != NULL && pacer_wait_at(pacer, (uint64_t) (sent * 8e3 / rate)) < 0) {
+			status = -1;
+			break;
+		}
+
+		if ((len = write_batch(sock, buf, bufsz, iov, batch)) < 0) {
+			status = -1;
+			break;
+		}
+		sent += len;
+
+		// report goodput every second
+		if ((now = now_ns()) - last >= REPORT_INTERVAL) {
+			acked = bytes_acked(sock);
+			fprintf(stdout, "%.3lf s: sent %.2lf Mbit/s, goodput %.2lf Mbit/s\n", (now - start) / 1e9,
+					(sent - last_sent) * 8e3 / (now - last), (acked - last_acked) * 8e3 / (now - last));
+			last_sent = sent;
+			last_acked = acked;
+			last = now;
+		}
+
+		if (len < bufsz * batch)
+			break;
+	}
+
+	now = now_ns();
+	fprintf(stdout, "Sent %" PRIu64 " bytes in %.2lf seconds (%.2lf Mbit/s)\n",
+			sent, (now - start) / 1e9, now > start ? sent * 8e3 / (now - start) : 0.0);
+
+	free(pacer);
+	free(iov);
+	free(buf);
+	return status;
+}
+
+
+
+/* Register arguments for the streamer */
+void streamer_init(void)
+{
+	register_argument("bufsz", NULL, 0);
+	register_argument("batch", NULL, 0);
+	register_argument("sndbuf", NULL, 0);
+	register_argument("lowat", NULL, 0);
+	register_argument("rate", NULL, 0);
+}
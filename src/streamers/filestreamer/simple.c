@@ -1,106 +1,389 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <linux/errqueue.h>
+#include <poll.h>
 #include <pcap.h>
+#include <errno.h>
 #include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
 #include "utils.h"
 #include "bootstrap.h"
 
 
+/* Largest chunk size */
+#define MAX_CHUNK (1 << 24)
+
+/* Number of congestion state samples kept */
+#define MAX_SAMPLES 65536
+
+/* Number of captured segments parsed per call */
+#define BATCH_SIZE 256
+
+/* Number of outstanding segments timed for RTT samples */
+#define RTT_WINDOW 16384
+
+/* Largest number of RTT samples taken from one acknowledgement */
+#define RTT_PER_ACK 64
+
+
+
 static int count_dupacks = 0;
 
 static int sample_rtt = 0;
 
+static int framed = 0;
+
+static int use_sendfile = 0;
+
+static int use_zerocopy = 0;
+
+
+
+/* Zero-copy send state */
+struct zc
+{
+	uint32_t sends;          // number of zero-copy sends
+	uint32_t done;           // number of completed sends
+	uint32_t copied;         // number of completed sends the kernel had to copy anyway
+};
+
+
+
+/* Reap zero-copy completions from the socket error queue */
+static int reap_completions(int sock, struct zc *zc, int timeout)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *err;
+	struct pollfd pfd = { .fd = sock, .events = 0 };
+
+	// POLLERR is always reported, so this waits for the error queue only
+	if (timeout > 0 && poll(&pfd, 1, timeout) <= 0)
+		return 0;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+			err = (struct sock_extended_err*) CMSG_DATA(cm);
+			if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			// completions are reported as a range of send numbers
+			zc->done += err->ee_data - err->ee_info + 1;
+			if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				zc->copied += err->ee_data - err->ee_info + 1;
+		}
+	}
+}
+
+
+
+/* Send len bytes, retrying short sends */
+static ssize_t send_all(int sock, char const *buf, size_t len, int flags, struct zc *zc)
+{
+	size_t total = 0;
+	ssize_t sent;
+
+	while (total < len) {
+		if ((sent = send(sock, buf + total, len - total, flags)) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			// too many pages pinned by unfinished zero-copy sends
+			if (errno == ENOBUFS && zc != NULL && reap_completions(sock, zc, 10) == 0)
+				continue;
+
+			return total > 0 ? (ssize_t) total : -1;
+		}
+
+		if (zc != NULL)
+			++zc->sends;
+		total += sent;
+	}
+
+	return total;
+}
+
+
+
+/* Send len bytes of a file with sendfile(), retrying short sends */
+static ssize_t send_file(int sock, int fd, off_t *offset, size_t len)
+{
+	size_t total = 0;
+	ssize_t sent;
+
+	while (total < len) {
+		if ((sent = sendfile(sock, fd, offset, len - total)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return total > 0 ? (ssize_t) total : -1;
+		}
+
+		if (sent == 0)
+			break; // end of file
+		total += sent;
+	}
+
+	return total;
+}
+
+
+
+/* CPU time used by the calling thread in seconds */
+static double cpu_time(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
 
 
 /* Send a file given to the streamer as argument using --file=filename */
 int streamer(int sock, const int *run, const char **args)
 {
-	int bufsz = 1460;
+	long bufsz = DEF_SIZE;
 	FILE *fp = NULL;
-	char *buf = NULL;
+	char *buf = NULL, *map = NULL;
+	struct stat st;
+	off_t offset = 0;
 	ssize_t len;
-	pcap_t *handle = NULL;
-	pkt_t pkt;
-	unsigned dupacks = 0, ack_hi = 0;
-	struct sockaddr_in addr;
-	unsigned rtt_sample = 0;
-	double rtt;
+	capthread_t *capture = NULL;
+	capstats_t capstats;
+	segbatch_t batch;
+	size_t i;
+	unsigned dupacks = 0;
+	uint32_t ack_hi = 0, seq = 0;
+	int acking = 0;
+	rtt_t rtt;
+	uint64_t rtts[RTT_PER_ACK];
+	size_t k, n;
+	double cpu;
+	pacer_t *pacer = NULL;
+	sampler_t *sampler = NULL;
+	unsigned long interval = 0, spin = 0;
+	uint64_t total = 0;
+	struct zc zc = { 0, 0, 0 };
+	int one = 1, status = 0;
+	int zerocopy = use_zerocopy; // cleared for this stream only if the socket refuses it
 
 
 	/* Parse arguments */
+	if (args[1] != NULL && ((bufsz = atol(args[1])) <= 0 || bufsz > MAX_CHUNK)) {
+		fprintf(stderr, "Invalid buffer size: '%s'\n", args[1]);
+		return -2;
+	}
+
+	if (args[5] != NULL && (interval = strtoul(args[5], NULL, 10)) == 0) {
+		fprintf(stderr, "Invalid interval: '%s'\n", args[5]);
+		return -2;
+	}
+	if (args[6] != NULL)
+		spin = strtoul(args[6], NULL, 10);
+
+	if (framed && (use_sendfile || zerocopy)) {
+		fprintf(stderr, "Frames can only be sent from a buffer\n");
+		return -2;
+	}
+
 	if ((fp = fopen(args[0], "r")) == NULL) {
 		fprintf(stderr, "Invalid file: %s\n", args[0]);
+		return -1;
 	}
-	if (args[1] != NULL && ((bufsz = atoi(args[1])) < 0 || bufsz > 2048)) {
-		fprintf(stderr, "Invalid buffer size: '%s'\n", args[1]);
-		return -2;
+
+	/* Map the file for zero-copy sends, pages are never reused before completion */
+	if (zerocopy) {
+		if (fstat(fileno(fp), &st) == -1 || st.st_size == 0
+				|| (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0)) == MAP_FAILED) {
+			fprintf(stderr, "Unable to map file: %s\n", args[0]);
+			fclose(fp);
+			return -1;
+		}
+
+		if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1) {
+			fprintf(stderr, "Zero-copy sends are not supported, copying instead\n");
+			zerocopy = 0;
+		}
 	}
 
 	/* Create capture handle */
-	if ((count_dupacks || sample_rtt) && create_handle(&handle, sock, 10) < 0) {
+	memset(&batch, 0, sizeof(batch));
+	memset(&rtt, 0, sizeof(rtt));
+	if ((count_dupacks || sample_rtt) && start_capture(&capture, sock, args[10] != NULL ? atoi(args[10]) : -1) < 0) {
 		fprintf(stderr, "Couldn't create handle, are you root?\n");
-		return -4;
+		status = -4;
+		goto out;
 	}
 
-	if (lookup_addr(sock, &addr, NULL) < 0) {
-		destroy_handle(handle);
-		return -4;
+	if (capture != NULL && segbatch_init(&batch, BATCH_SIZE) < 0) {
+		perror("segbatch_init");
+		status = -4;
+		goto out;
+	}
+
+	if (sample_rtt && rtt_init(&rtt, RTT_WINDOW) < 0) {
+		perror("rtt_init");
+		status = -4;
+		goto out;
 	}
 
 	/* Allocate buffer */
-	if ((buf = malloc(bufsz)) == NULL) {
+	if (!use_sendfile && map == NULL && (buf = malloc(bufsz)) == NULL) {
 		perror("malloc");
-		return -4;
+		status = -4;
+		goto out;
 	}
 
-	/* Run streamer */
-	while (*run && !ferror(fp) && !feof(fp)) {
+	/* Send on fixed deadlines */
+	if (interval > 0) {
+		if ((pacer = malloc(sizeof(pacer_t))) == NULL) {
+			perror("malloc");
+			status = -4;
+			goto out;
+		}
+		pacer_init(pacer, interval * 1000ULL, spin * 1000ULL);
+	}
+
+	/* Sample the congestion state after sends, at most every given microsecond */
+	if (args[9] != NULL) {
+		if ((sampler = malloc(sizeof(sampler_t))) == NULL
+				|| sampler_init(sampler, sock, MAX_SAMPLES, strtoull(args[9], NULL, 10) * 1000ULL) < 0) {
+			perror("malloc");
+			free(sampler);
+			sampler = NULL;
+			status = -4;
+			goto out;
+		}
+	}
 
-		// read from file
-		len = fread(buf, sizeof(char), bufsz, fp);
+	/* Run streamer */
+	cpu = cpu_time();
+	while (*run) {
 
-		// send to receiver
-		if (send(sock, buf, len, 0) < 0)
+		// wait until it is time to send
+		if (pacer != NULL && pacer_wait(pacer) < 0)
 			break;
 
-		// print packet timestamps
-		while (*run && (count_dupacks || sample_rtt) && parse_segment(handle, &pkt) > 0) {
-			if (sample_rtt && pkt.src.sin_addr.s_addr == addr.sin_addr.s_addr &&
-					pkt.src.sin_port == addr.sin_port) {
+		// send the next chunk to receiver
+		if (use_sendfile) {
+			len = send_file(sock, fileno(fp), &offset, bufsz);
 
-				if (rtt_sample == 0) {
-					rtt_sample = pkt.seq + pkt.len;
-					rtt = pkt.ts.tv_sec * 1000.0 * 1000.0 + pkt.ts.tv_usec;
-				}
+		} else if (map != NULL) {
+			len = st.st_size - offset < bufsz ? st.st_size - offset : bufsz;
+			if (len > 0 && (len = send_all(sock, map + offset, len, zerocopy ? MSG_ZEROCOPY : 0, zerocopy ? &zc : NULL)) > 0)
+				offset += len;
+			if (zerocopy)
+				reap_completions(sock, &zc, 0);
 
-			} else if (pkt.dst.sin_addr.s_addr == addr.sin_addr.s_addr &&
-					pkt.dst.sin_port == addr.sin_port) {
+		} else if ((len = fread(buf, sizeof(char), bufsz, fp)) > 0) {
+			if (framed)
+				len = send_frame(sock, buf, len, seq++);
+			else
+				len = send_all(sock, buf, len, 0, NULL);
+		}
+
+		if (len <= 0)
+			break;
+		total += len;
 
-				if (rtt_sample != 0 && pkt.ack > rtt_sample) {
-					rtt = (pkt.ts.tv_sec * 1000.0 * 1000.0 + pkt.ts.tv_usec) - rtt;
-					fprintf(stdout, "%lu.%06lu RTT sampled to %.2lf ms\n", pkt.ts.tv_sec, pkt.ts.tv_usec, rtt / 1000.0);
-					rtt_sample = 0;
+		if (sampler != NULL)
+			sampler_poll(sampler);
+
+		// print timestamps of the segments captured so far, without waiting for more
+		while (*run && capture != NULL && next_segments(capture, &batch) > 0) {
+			for (i = 0; i < batch.count; ++i) {
+				if (batch.dir[i]) {
+					if (sample_rtt)
+						rtt_sent(&rtt, batch.seq[i], batch.len[i], batch.ts[i]);
+					continue;
 				}
 
-				if (count_dupacks && pkt.ack > ack_hi) {
-					ack_hi = pkt.ack;
+				// every segment the acknowledgement covers is a sample
+				n = sample_rtt ? rtt_acked(&rtt, batch.ack[i], batch.ts[i], rtts, RTT_PER_ACK) : 0;
+				for (k = 0; k < n; ++k)
+					fprintf(stdout, "%" PRIu64 ".%06" PRIu64 " RTT sampled to %.2lf ms\n",
+							batch.ts[i] / 1000000000, batch.ts[i] % 1000000000 / 1000, rtts[k] / 1e6);
+
+				// sequence numbers wrap, so compare them modulo 2^32
+				if (count_dupacks && (!acking || (int32_t) (batch.ack[i] - ack_hi) > 0)) {
+					ack_hi = batch.ack[i];
+					acking = 1;
 					dupacks = 0;
-				} else if (count_dupacks && pkt.ack == ack_hi && ++dupacks >= 3) {
-					fprintf(stdout, "%lu.%06lu %d dupACKs for %u\n", pkt.ts.tv_sec, pkt.ts.tv_usec, dupacks, ack_hi);
+				} else if (count_dupacks && batch.ack[i] == ack_hi && ++dupacks >= 3) {
+					fprintf(stdout, "%" PRIu64 ".%06" PRIu64 " %d dupACKs for %u\n",
+							batch.ts[i] / 1000000000, batch.ts[i] % 1000000000 / 1000, dupacks, ack_hi);
 				}
 			}
+
+			if (batch.count < batch.size)
+				break;
 		}
 	}
 
+	// wait a little while for the last zero-copy sends to complete
+	while (zerocopy && zc.done != zc.sends && reap_completions(sock, &zc, 100) == 0 && *run);
+	cpu = cpu_time() - cpu;
+
+	/* Report */
+	fprintf(stdout, "Sent %" PRIu64 " bytes using %.3lf CPU seconds (%.1lf MB per CPU-second)\n",
+			total, cpu, cpu > 0 ? total / cpu / 1e6 : 0.0);
+	if (zerocopy)
+		fprintf(stdout, "%u zero-copy sends, %u completed, %u copied by the kernel anyway\n",
+				zc.sends, zc.done, zc.copied);
+
+	if (pacer != NULL && pacer->error.count > 0) {
+		fprintf(stdout, "Send time error: p50 %.3lf us, p99 %.3lf us, max %.3lf us (%" PRIu64 " deadlines missed)\n",
+				hist_percentile(&pacer->error, 50.0) / 1e3, hist_percentile(&pacer->error, 99.0) / 1e3,
+				pacer->error.max / 1e3, pacer->missed);
+	}
+
+	if (capture != NULL) {
+		memset(&capstats, 0, sizeof(capstats));
+		stop_capture(capture, &capstats);
+		capture = NULL;
+		fprintf(stdout, "Captured %" PRIu64 " frames, %" PRIu64 " dropped by the kernel, %" PRIu64 " not processed in time\n",
+				capstats.packets, capstats.drops, capstats.overruns);
+	}
+
+	if (sample_rtt)
+		fprintf(stdout, "%" PRIu64 " RTT samples, %" PRIu64 " segments not sampled because they were retransmitted, %" PRIu64 " not timed\n",
+				rtt.samples, rtt.karn, rtt.untimed);
+
+	if (sampler != NULL)
+		sampler_dump(sampler, stdout);
+
 	/* Exit gracefully */
-	destroy_handle(handle);
+out:
+	if (sampler != NULL)
+		sampler_free(sampler);
+	free(sampler);
+	free(pacer);
+	if (capture != NULL)
+		stop_capture(capture, NULL);
+	segbatch_free(&batch);
+	rtt_free(&rtt);
 	free(buf);
-	if (fp != NULL)
-		fclose(fp);
+	if (map != NULL)
+		munmap(map, st.st_size);
+	fclose(fp);
 
-	return 0;
+	return status;
 }
 
 /* Register arguments for the streamer */
@@ -110,4 +393,11 @@ void streamer_init(void)
 	register_argument("bufsz", NULL, 0);
 	register_argument("show-dupacks", &count_dupacks, 1);
 	register_argument("show-rtt", &sample_rtt, 1);
+	register_argument("frames", &framed, 1);
+	register_argument("interval", NULL, 0);
+	register_argument("spin", NULL, 0);
+	register_argument("sendfile", &use_sendfile, 1);
+	register_argument("zerocopy", &use_zerocopy, 1);
+	register_argument("tcpinfo", NULL, 0);
+	register_argument("capture-cpu", NULL, 0);
 }
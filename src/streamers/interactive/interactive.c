@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdio.h>
+#include "events.h"
+#include "bootstrap.h"
+
+
+/* Default message size (bytes) */
+#define MSG_SIZE 100
+
+/* Default time between messages (microseconds), e.g. a VoIP frame */
+#define MSG_INTERVAL 20000
+
+
+
+/* Per-stream state */
+struct state
+{
+	char *buf;               // message buffer
+	size_t size;             // message size
+	uint64_t pending;        // bytes queued while the send buffer was full
+	uint64_t sent;           // number of messages sent
+	uint64_t missed;         // number of ticks we were too late for
+};
+
+
+
+/* Write queued messages until the send buffer is full */
+static int flush(stream_ev_t *stream)
+{
+	struct state *st = stream->data;
+	ssize_t len;
+
+	while (st->pending > 0) {
+		len = send(stream->conn, st->buf, st->pending < st->size ? st->pending : st->size, MSG_NOSIGNAL);
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (len < 0)
+			return -1;
+		st->pending -= len;
+	}
+
+	// only wait for writability while there is a backlog
+	stream->want_write = st->pending > 0;
+	return 0;
+}
+
+
+
+/* Set up a stream */
+static int on_open(stream_ev_t *stream, char const **args)
+{
+	struct state *st;
+	long size = MSG_SIZE, interval = MSG_INTERVAL;
+
+	if (args[0] != NULL && (size = atol(args[0])) <= 0) {
+		fprintf(stderr, "Invalid message size: '%s'\n", args[0]);
+		return -2;
+	}
+	if (args[1] != NULL && (interval = atol(args[1])) <= 0) {
+		fprintf(stderr, "Invalid interval: '%s'\n", args[1]);
+		return -2;
+	}
+
+	if ((st = calloc(1, sizeof(struct state))) == NULL || (st->buf = calloc(size, 1)) == NULL) {
+		perror("calloc");
+		free(st);
+		return -4;
+	}
+	st->size = size;
+
+	stream->data = st;
+	stream->interval = interval * 1000ULL;
+	return 0;
+}
+
+
+
+/* Queue a message every tick */
+static int on_timer(stream_ev_t *stream, uint64_t expirations)
+{
+	struct state *st = stream->data;
+
+	st->missed += expirations - 1;
+	st->pending += st->size;
+	++st->sent;
+
+	return flush(stream);
+}
+
+
+
+/* Send the remaining backlog */
+static int on_writable(stream_ev_t *stream)
+{
+	return flush(stream);
+}
+
+
+
+/* Report and free a stream */
+static int on_close(stream_ev_t *stream)
+{
+	struct state *st = stream->data;
+
+	if (st == NULL)
+		return 0;
+
+	fprintf(stdout, "Sent %" PRIu64 " messages of %zu bytes (%" PRIu64 " ticks missed, %" PRIu64 " bytes still queued)\n",
+			st->sent, st->size, st->missed, st->pending);
+
+	free(st->buf);
+	free(st);
+	return 0;
+}
+
+
+
+/* Event-driven streamer callbacks */
+events_t const streamer_events = {
+	.open = &on_open,
+	.on_writable = &on_writable,
+	.on_timer = &on_timer,
+	.on_ack = NULL,
+	.close = &on_close
+};
+
+
+
+/* Register arguments for the streamer */
+void streamer_init(void)
+{
+	register_argument("size", NULL, 0);
+	register_argument("interval", NULL, 0);
+}
@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <time.h>
+#include <stdio.h>
+#include "utils.h"
+#include "events.h"
+#include "bootstrap.h"
+#include "variates.h"
+
+
+/* Number of variates generated at a time */
+#define BATCH 64
+
+/* Largest message size (bytes) */
+#define MAX_SIZE 65536
+
+/* Default message size distribution */
+#define DEF_MSG_SIZE "fixed:100"
+
+/* Default seed */
+#define DEF_SEED 1
+
+/* Largest number of messages queued per timer expiration */
+#define MAX_QUEUED 1024
+
+
+
+/* Message payload (contents don't matter) */
+static char const payload[MAX_SIZE];
+
+/* Number of streams opened so far, every stream gets its own sequence */
+static uint64_t num_streams = 0;
+
+
+
+/* Per-stream state */
+struct state
+{
+	rng_t rng;               // random number generator of this stream
+	dist_t gap;              // distribution of inter-arrival times (us)
+	dist_t size;             // distribution of message sizes (bytes)
+	double gaps[BATCH];      // pre-generated inter-arrival times
+	double sizes[BATCH];     // pre-generated message sizes
+	unsigned next;           // next unused variate
+	uint64_t due;            // send time of the next message
+	uint64_t pending;        // bytes queued while the send buffer was full
+	uint64_t sent;           // number of messages
+	uint64_t bytes;          // number of bytes in messages
+	uint64_t late;           // number of messages queued after their send time
+};
+
+
+
+/* Current time in nanoseconds (the clock used for event deadlines) */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(PACE_CLOCK, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+
+/* Write queued messages until the send buffer is full */
+static int flush(stream_ev_t *stream)
+{
+	struct state *st = stream->data;
+	ssize_t len;
+
+	while (st->pending > 0) {
+		len = send(stream->conn, payload, st->pending < MAX_SIZE ? st->pending : MAX_SIZE, MSG_NOSIGNAL);
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (len < 0)
+			return -1;
+		st->pending -= len;
+	}
+
+	stream->want_write = st->pending > 0;
+	return 0;
+}
+
+
+
+/* Set up a stream */
+static int on_open(stream_ev_t *stream, char const **args)
+{
+	struct state *st;
+	uint64_t seed = DEF_SEED;
+
+	if ((st = calloc(1, sizeof(struct state))) == NULL) {
+		perror("calloc");
+		return -4;
+	}
+
+	// gaps below a nanosecond would queue messages without the clock moving on
+	if (parse_dist(&st->gap, args[0]) < 0 || !(dist_mean(&st->gap) * 1000.0 >= 1.0)) {
+		fprintf(stderr, "Invalid inter-arrival distribution: '%s'\n", args[0]);
+		free(st);
+		return -2;
+	}
+
+	if (parse_dist(&st->size, args[1] != NULL ? args[1] : DEF_MSG_SIZE) < 0) {
+		fprintf(stderr, "Invalid size distribution: '%s'\n", args[1]);
+		free(st);
+		return -2;
+	}
+
+	if (args[2] != NULL)
+		seed = strtoull(args[2], NULL, 0);
+
+	// streams are numbered in the order they are opened
+	rng_seed(&st->rng, seed + __atomic_fetch_add(&num_streams, 1, __ATOMIC_RELAXED));
+	st->next = BATCH;
+
+	stream->data = st;
+	st->due = now_ns();
+	stream->deadline = st->due;
+	return 0;
+}
+
+
+
+/* Queue the messages that are due and schedule the next one */
+static int on_timer(stream_ev_t *stream, uint64_t expirations)
+{
+	struct state *st = stream->data;
+	uint64_t now = now_ns();
+	unsigned queued = 0;
+	uint64_t gap;
+	double size;
+
+	(void) expirations;
+
+	// when far behind, let the event loop serve the other streams before catching up
+	while (st->due <= now && queued < MAX_QUEUED) {
+		if (st->next == BATCH) {
+			dist_fill(&st->gap, &st->rng, st->gaps, BATCH);
+			dist_fill(&st->size, &st->rng, st->sizes, BATCH);
+			st->next = 0;
+		}
+
+		size = st->sizes[st->next];
+		size = size < 1 ? 1 : (size > MAX_SIZE ? MAX_SIZE : size);
+		st->pending += (uint64_t) size;
+		st->bytes += (uint64_t) size;
+		++st->sent;
+
+		// messages after the first were due before we woke up
+		st->late += queued++ > 0;
+		gap = (uint64_t) (st->gaps[st->next++] * 1000.0);
+		st->due += gap > 0 ? gap : 1;
+	}
+
+	stream->deadline = st->due;
+	return flush(stream);
+}
+
+
+
+/* Send the remaining backlog */
+static int on_writable(stream_ev_t *stream)
+{
+	return flush(stream);
+}
+
+
+
+/* Report and free a stream */
+static int on_close(stream_ev_t *stream)
+{
+	struct state *st = stream->data;
+
+	if (st == NULL)
+		return 0;
+
+	fprintf(stdout, "Sent %" PRIu64 " messages, %" PRIu64 " bytes (%" PRIu64 " sent late, %" PRIu64 " bytes still queued)\n",
+			st->sent, st->bytes, st->late, st->pending);
+
+	free(st);
+	return 0;
+}
+
+
+
+/* Event-driven streamer callbacks */
+events_t const streamer_events = {
+	.open = &on_open,
+	.on_writable = &on_writable,
+	.on_timer = &on_timer,
+	.on_ack = NULL,
+	.close = &on_close
+};
+
+
+
+/* Register arguments for the streamer */
+void streamer_init(void)
+{
+	register_argument("gap", NULL, 1);
+	register_argument("size", NULL, 0);
+	register_argument("seed", NULL, 0);
+}
@@ -0,0 +1,296 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include "variates.h"
+
+
+/* Cached tables of empirical distributions */
+struct table
+{
+	struct table *next;
+	char *filename;
+	cdf_t cdf;
+};
+
+static struct table *tables = NULL;
+
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/* Rotate left */
+static inline uint64_t rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+
+
+/* Next value of a splitmix64 sequence, used for seeding */
+static uint64_t splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+
+
+/* Seed a generator */
+void rng_seed(rng_t *rng, uint64_t seed)
+{
+	unsigned i, l;
+
+	for (l = 0; l < RNG_LANES; ++l)
+		for (i = 0; i < 4; ++i)
+			rng->s[i][l] = splitmix64(&seed);
+}
+
+
+
+/* Fill out with n uniform variates in (0, 1] */
+void rng_uniform(rng_t *rng, double *out, unsigned n)
+{
+	uint64_t r[RNG_LANES], t;
+	unsigned i, l;
+
+	for (i = 0; i < n; i += RNG_LANES) {
+
+		// advance all lanes in lockstep (xoshiro256**)
+		for (l = 0; l < RNG_LANES; ++l) {
+			r[l] = rotl(rng->s[1][l] * 5, 7) * 9;
+			t = rng->s[1][l] << 17;
+			rng->s[2][l] ^= rng->s[0][l];
+			rng->s[3][l] ^= rng->s[1][l];
+			rng->s[1][l] ^= rng->s[2][l];
+			rng->s[0][l] ^= rng->s[3][l];
+			rng->s[2][l] ^= t;
+			rng->s[3][l] = rotl(rng->s[3][l], 45);
+		}
+
+		// top 53 bits, shifted by one so that we never return zero
+		for (l = 0; l < RNG_LANES && i + l < n; ++l)
+			out[i + l] = ((r[l] >> 11) + 1) * 0x1.0p-53;
+	}
+}
+
+
+
+/* Load a table of an empirical distribution */
+static int load_cdf(cdf_t *cdf, char const *filename)
+{
+	FILE *fp;
+	double value, prob;
+	unsigned cap = 0;
+	void *tmp;
+
+	memset(cdf, 0, sizeof(cdf_t));
+	if ((fp = fopen(filename, "r")) == NULL)
+		return -1;
+
+	while (fscanf(fp, "%lf %lf", &value, &prob) == 2) {
+		if (prob < 0 || prob > 1 || (cdf->n > 0 && (value < cdf->value[cdf->n-1] || prob < cdf->prob[cdf->n-1])))
+			goto error;
+
+		if (cdf->n == cap) {
+			cap = cap > 0 ? cap * 2 : 64;
+			if ((tmp = realloc(cdf->value, sizeof(double) * cap)) == NULL)
+				goto error;
+			cdf->value = tmp;
+			if ((tmp = realloc(cdf->prob, sizeof(double) * cap)) == NULL)
+				goto error;
+			cdf->prob = tmp;
+		}
+
+		cdf->value[cdf->n] = value;
+		cdf->prob[cdf->n] = prob;
+		++cdf->n;
+	}
+
+	if (cdf->n == 0 || !feof(fp))
+		goto error;
+
+	// make sure every variate maps to a value
+	cdf->prob[cdf->n-1] = 1.0;
+	fclose(fp);
+	return 0;
+
+error:
+	free(cdf->value);
+	free(cdf->prob);
+	fclose(fp);
+	return -1;
+}
+
+
+
+/* Find a cached table or load it */
+static cdf_t const* find_cdf(char const *filename)
+{
+	struct table *t;
+
+	pthread_mutex_lock(&tables_lock);
+	for (t = tables; t != NULL; t = t->next)
+		if (strcmp(t->filename, filename) == 0)
+			break;
+
+	if (t == NULL && (t = calloc(1, sizeof(struct table))) != NULL) {
+		if ((t->filename = strdup(filename)) == NULL || load_cdf(&t->cdf, filename) < 0) {
+			free(t->filename);
+			free(t);
+			t = NULL;
+		} else {
+			t->next = tables;
+			tables = t;
+		}
+	}
+	pthread_mutex_unlock(&tables_lock);
+
+	return t != NULL ? &t->cdf : NULL;
+}
+
+
+
+/* Parse a distribution */
+int parse_dist(dist_t *dist, char const *str)
+{
+	char *end = NULL;
+
+	memset(dist, 0, sizeof(dist_t));
+
+	if (strncmp(str, "cdf:", 4) == 0) {
+		dist->type = DIST_CDF;
+		return (dist->cdf = find_cdf(str + 4)) != NULL ? 0 : -1;
+
+	} else if (strncmp(str, "fixed:", 6) == 0) {
+		dist->type = DIST_FIXED;
+		dist->a = strtod(str + 6, &end);
+
+	} else if (strncmp(str, "exp:", 4) == 0) {
+		dist->type = DIST_EXP;
+		dist->a = strtod(str + 4, &end);
+
+	} else if (strncmp(str, "pareto:", 7) == 0) {
+		dist->type = DIST_PARETO;
+		dist->a = strtod(str + 7, &end);
+		if (*end++ != ':')
+			return -1;
+		dist->b = strtod(end, &end);
+
+	} else if (strncmp(str, "lognormal:", 10) == 0) {
+		dist->type = DIST_LOGNORMAL;
+		dist->a = strtod(str + 10, &end);
+		if (*end++ != ':')
+			return -1;
+		dist->b = strtod(end, &end);
+
+	} else {
+		dist->type = DIST_FIXED;
+		dist->a = strtod(str, &end);
+	}
+
+	if (end == NULL || *end != '\0')
+		return -1;
+
+	if (dist->type == DIST_PARETO && (dist->a <= 0 || dist->b <= 0))
+		return -1;
+
+	return dist->type != DIST_LOGNORMAL && dist->a < 0 ? -1 : 0;
+}
+
+
+
+/* Mean of a distribution */
+double dist_mean(dist_t const *dist)
+{
+	cdf_t const *cdf = dist->cdf;
+	double mean;
+	unsigned i;
+
+	switch (dist->type) {
+		case DIST_FIXED:
+		case DIST_EXP:
+			return dist->a;
+
+		case DIST_PARETO:
+			if (dist->b <= 0)
+				return 0;
+			return dist->a > 1 ? dist->a * dist->b / (dist->a - 1) : INFINITY;
+
+		case DIST_LOGNORMAL:
+			return exp(dist->a + dist->b * dist->b / 2);
+
+		case DIST_CDF: // every value takes the probability step up to it
+			mean = cdf->value[0] * cdf->prob[0];
+			for (i = 1; i < cdf->n; ++i)
+				mean += cdf->value[i] * (cdf->prob[i] - cdf->prob[i-1]);
+			return mean;
+
+		default:
+			return 0;
+	}
+}
+
+
+
+/* Fill out with n variates from a distribution */
+void dist_fill(dist_t const *dist, rng_t *rng, double *out, unsigned n)
+{
+	cdf_t const *cdf = dist->cdf;
+	unsigned i, lo, hi, mid;
+	double u, v;
+
+	if (dist->type == DIST_FIXED) {
+		for (i = 0; i < n; ++i)
+			out[i] = dist->a;
+		return;
+	}
+
+	rng_uniform(rng, out, n);
+
+	switch (dist->type) {
+		case DIST_EXP: // inverse transform
+			for (i = 0; i < n; ++i)
+				out[i] = -dist->a * log(out[i]);
+			break;
+
+		case DIST_PARETO: // inverse transform
+			for (i = 0; i < n; ++i)
+				out[i] = dist->b / pow(out[i], 1.0 / dist->a);
+			break;
+
+		case DIST_LOGNORMAL: // Box-Muller, two normal variates per pair of uniforms
+			for (i = 0; i + 1 < n; i += 2) {
+				u = sqrt(-2.0 * log(out[i]));
+				v = 2.0 * M_PI * out[i+1];
+				out[i] = exp(dist->a + dist->b * u * cos(v));
+				out[i+1] = exp(dist->a + dist->b * u * sin(v));
+			}
+			if (i < n) {
+				// the other uniforms are used up, draw a fresh one for the angle
+				rng_uniform(rng, &v, 1);
+				out[i] = exp(dist->a + dist->b * sqrt(-2.0 * log(out[i])) * cos(2.0 * M_PI * v));
+			}
+			break;
+
+		case DIST_CDF: // binary search for the first value with a cumulative probability >= u
+			for (i = 0; i < n; ++i) {
+				for (lo = 0, hi = cdf->n - 1; lo < hi; ) {
+					mid = (lo + hi) / 2;
+					if (cdf->prob[mid] < out[i])
+						lo = mid + 1;
+					else
+						hi = mid;
+				}
+				out[i] = cdf->value[lo];
+			}
+			break;
+
+		default:
+			break;
+	}
+}
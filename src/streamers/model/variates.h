@@ -0,0 +1,76 @@
+#ifndef __VARIATES__
+#define __VARIATES__
+
+#include <stdint.h>
+
+
+/* Number of independent generator lanes, the state is laid out so that all
+ * lanes can be advanced with the same vector instructions
+ */
+#define RNG_LANES 4
+
+
+
+/* Pseudo-random number generator (xoshiro256**, one per lane) */
+typedef struct {
+	uint64_t s[4][RNG_LANES];
+} rng_t;
+
+
+
+/* Seed a generator
+ *
+ * The state is expanded from seed with splitmix64, so the same seed always
+ * gives the same sequence.
+ */
+void rng_seed(rng_t* rng, uint64_t seed);
+
+
+
+/* Fill out with n uniform variates in (0, 1] */
+void rng_uniform(rng_t* rng, double* out, unsigned n);
+
+
+
+/* Empirical distribution, loaded from a file */
+typedef struct {
+	unsigned n;              // number of points
+	double* value;           // values in increasing order
+	double* prob;            // cumulative probability of each value
+} cdf_t;
+
+
+
+/* Probability distribution */
+typedef struct {
+	enum { DIST_FIXED, DIST_EXP, DIST_PARETO, DIST_LOGNORMAL, DIST_CDF } type;
+	double a;                // value, mean, shape or mu
+	double b;                // scale or sigma
+	cdf_t const* cdf;        // table of an empirical distribution
+} dist_t;
+
+
+
+/* Parse a distribution
+ *
+ * Accepted forms are fixed:value, exp:mean, pareto:shape:scale,
+ * lognormal:mu:sigma (of the logarithm of the value) and cdf:filename, where
+ * the file has a value and its cumulative probability on every line.
+ * A plain number is the same as fixed:number. Tables read from files are
+ * cached and shared by all distributions using the same file.
+ *
+ * Returns 0 and loads dist on success, or a negative value on failure.
+ */
+int parse_dist(dist_t* dist, char const* str);
+
+
+
+/* Mean of a distribution (INFINITY if it has none) */
+double dist_mean(dist_t const* dist);
+
+
+
+/* Fill out with n variates from a distribution */
+void dist_fill(dist_t const* dist, rng_t* rng, double* out, unsigned n);
+
+#endif
@@ -0,0 +1,311 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <byteswap.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include "utils.h"
+#include "bootstrap.h"
+
+
+/* Magic numbers of the pcap file format (microsecond and nanosecond timestamps) */
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+
+
+
+/* pcap file header */
+struct file_hdr
+{
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+
+
+/* pcap record header */
+struct record_hdr
+{
+	uint32_t ts_sec;
+	uint32_t ts_frac;        // microseconds or nanoseconds, see the magic number
+	uint32_t caplen;
+	uint32_t len;
+};
+
+
+
+/* A write to replay */
+struct write
+{
+	uint64_t offset;         // send time relative to the first write (ns)
+	uint32_t len;            // number of bytes
+};
+
+
+
+static int loop = 0;
+
+
+
+/* Parse a flow endpoint on the form address:port */
+static int parse_flow(char const *str, struct sockaddr_in *addr)
+{
+	char host[INET_ADDRSTRLEN];
+	char const *sep;
+
+	if ((sep = strrchr(str, ':')) == NULL || (size_t) (sep - str) >= sizeof(host))
+		return -1;
+
+	memcpy(host, str, sep - str);
+	host[sep - str] = '\0';
+	if (inet_pton(AF_INET, host, &addr->sin_addr) != 1)
+		return -1;
+
+	addr->sin_port = htons(atoi(sep + 1));
+	return 0;
+}
+
+
+
+/* Decode the writes of one flow from a memory-mapped capture file
+ *
+ * Only data not seen before is counted, so retransmissions in the capture
+ * are not replayed. If flow has no port, the first segment carrying data
+ * selects the flow.
+ *
+ * Returns the number of writes and loads writes on success, or a negative
+ * value on failure.
+ */
+static long decode_trace(uint8_t const *data, size_t size, struct sockaddr_in *flow, struct write **writes)
+{
+	struct file_hdr const *fh = (struct file_hdr const*) data;
+	struct record_hdr rh;
+	struct timeval tv;
+	struct write *tmp;
+	pkt_t seg;
+	size_t pos = sizeof(struct file_hdr);
+	uint64_t ts, first = 0;
+	uint32_t next_seq = 0, end;
+	long n = 0, cap = 0;
+	int swapped, nsec, linktype, status;
+
+	*writes = NULL;
+	if (size < sizeof(struct file_hdr))
+		return -1;
+
+	swapped = fh->magic == bswap_32(PCAP_MAGIC_US) || fh->magic == bswap_32(PCAP_MAGIC_NS);
+	nsec = fh->magic == PCAP_MAGIC_NS || fh->magic == bswap_32(PCAP_MAGIC_NS);
+	if (!swapped && fh->magic != PCAP_MAGIC_US && fh->magic != PCAP_MAGIC_NS)
+		return -1;
+
+	linktype = swapped ? bswap_32(fh->linktype) : fh->linktype;
+
+	while (pos + sizeof(struct record_hdr) <= size) {
+		memcpy(&rh, data + pos, sizeof(rh));
+		if (swapped) {
+			rh.ts_sec = bswap_32(rh.ts_sec);
+			rh.ts_frac = bswap_32(rh.ts_frac);
+			rh.caplen = bswap_32(rh.caplen);
+			rh.len = bswap_32(rh.len);
+		}
+		pos += sizeof(struct record_hdr);
+		if (pos + rh.caplen > size)
+			break; // truncated capture
+
+		tv.tv_sec = rh.ts_sec;
+		tv.tv_usec = nsec ? rh.ts_frac / 1000 : rh.ts_frac;
+		ts = rh.ts_sec * 1000000000ULL + (nsec ? rh.ts_frac : rh.ts_frac * 1000ULL);
+
+		if ((status = decode_segment(linktype, data + pos, rh.caplen, tv, &seg)) < 0) {
+			fprintf(stderr, "Captures of link type %d can't be replayed\n", linktype);
+			free(*writes);
+			*writes = NULL;
+			return -1;
+		}
+
+		if (status == 1 && seg.len > 0) {
+
+			// select the first flow carrying data
+			if (flow->sin_port == 0) {
+				flow->sin_addr = seg.src.sin_addr;
+				flow->sin_port = seg.src.sin_port;
+			}
+
+			if (seg.src.sin_addr.s_addr == flow->sin_addr.s_addr && seg.src.sin_port == flow->sin_port) {
+
+				// skip retransmitted data
+				end = seg.seq + seg.len;
+				if (n > 0 && (int32_t) (end - next_seq) <= 0) {
+					pos += rh.caplen;
+					continue;
+				}
+				if (n > 0 && (int32_t) (seg.seq - next_seq) < 0)
+					seg.len = end - next_seq;
+				next_seq = end;
+
+				if (n == cap) {
+					cap = cap > 0 ? cap * 2 : 1024;
+					if ((tmp = realloc(*writes, sizeof(struct write) * cap)) == NULL) {
+						free(*writes);
+						*writes = NULL;
+						return -1;
+					}
+					*writes = tmp;
+				}
+
+				if (n == 0)
+					first = ts;
+				(*writes)[n].offset = ts - first;
+				(*writes)[n].len = seg.len;
+				++n;
+			}
+		}
+
+		pos += rh.caplen;
+	}
+
+	return n;
+}
+
+
+
+/* Read the writes of a flow from a capture file */
+static long load_trace(char const *filename, struct sockaddr_in *flow, struct write **writes)
+{
+	struct stat st;
+	void *data;
+	long n;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) == -1)
+		return -1;
+
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+
+	if ((data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	n = decode_trace(data, st.st_size, flow, writes);
+
+	munmap(data, st.st_size);
+	return n;
+}
+
+
+
+/* Replay the write pattern of a flow from a capture file */
+int streamer(int sock, const int *run, const char **args)
+{
+	struct write *writes = NULL;
+	struct sockaddr_in flow;
+	char name[INET_ADDRSTRLEN];
+	pacer_t *pacer = NULL;
+	char *buf = NULL;
+	uint64_t base = 0, bytes = 0;
+	uint32_t maxlen = 0;
+	long i, n;
+	ssize_t len, sent;
+	int status = 0;
+
+	/* Parse arguments */
+	memset(&flow, 0, sizeof(flow));
+	flow.sin_family = AF_INET;
+	if (args[1] != NULL && parse_flow(args[1], &flow) < 0) {
+		fprintf(stderr, "Invalid flow: '%s'\n", args[1]);
+		return -2;
+	}
+
+	/* Decode the trace before we start, so that file access can't disturb the timing */
+	if ((n = load_trace(args[0], &flow, &writes)) <= 0) {
+		fprintf(stderr, "No data to replay in trace: %s\n", args[0]);
+		free(writes);
+		return -1;
+	}
+
+	for (i = 0; i < n; ++i)
+		maxlen = writes[i].len > maxlen ? writes[i].len : maxlen;
+
+	pacer = malloc(sizeof(pacer_t));
+	buf = calloc(maxlen, sizeof(char));
+	if (pacer == NULL || buf == NULL) {
+		perror("malloc");
+		free(writes);
+		free(pacer);
+		free(buf);
+		return -4;
+	}
+
+	lookup_name(flow, name, sizeof(name));
+	fprintf(stdout, "Replaying %ld writes from %s:%u, lasting %.3lf seconds\n",
+			n, name, ntohs(flow.sin_port), writes[n-1].offset / 1e9);
+
+	/* Run streamer */
+	pacer_init(pacer, 0, args[2] != NULL ? strtoull(args[2], NULL, 10) * 1000ULL : 0);
+	for (i = 0; *run && status == 0; ++i) {
+
+		if (i == n) {
+			if (!loop)
+				break;
+
+			// start over after the last write, keeping the gap to the first
+			base += writes[n-1].offset + (n > 1 ? writes[1].offset : 0);
+			i = 0;
+		}
+
+		if (pacer_wait_at(pacer, base + writes[i].offset) < 0) {
+			status = -1;
+			break;
+		}
+
+		// short writes are completed before the next write is due
+		for (len = 0; *run && len < writes[i].len; len += sent) {
+			if ((sent = send(sock, buf, writes[i].len - len, 0)) < 0 && errno == EINTR)
+				sent = 0;
+			else if (sent < 0) {
+				status = -1;
+				break;
+			}
+		}
+		bytes += len;
+	}
+
+	fprintf(stdout, "Replayed %" PRIu64 " bytes, send time error: p50 %.3lf us, p99 %.3lf us, max %.3lf us\n",
+			bytes, hist_percentile(&pacer->error, 50.0) / 1e3, hist_percentile(&pacer->error, 99.0) / 1e3,
+			pacer->error.max / 1e3);
+
+	free(buf);
+	free(pacer);
+	free(writes);
+	return status;
+}
+
+
+
+/* Register arguments for the streamer */
+void streamer_init(void)
+{
+	register_argument("trace", NULL, 1);
+	register_argument("flow", NULL, 0);
+	register_argument("spin", NULL, 0);
+	register_argument("loop", &loop, 1);
+}